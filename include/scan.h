@@ -0,0 +1,31 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+// Bulk input scanner: marks newlines, and the blanks and operator bytes that
+// can end a word, across a whole block at once. Bit i of word i / 64 of a
+// mask stands for byte i. The SIMD version used is picked at runtime.
+// Independent of sfish.h so tools can link it alone.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes set in the ops mask
+#define SCAN_OPS " \t|<>&;()$\"'"
+
+// Words needed for a mask over len bytes
+#define SCAN_WORDS(len) (((len) + 63) / 64)
+
+// Fill SCAN_WORDS(len) words of nl and ops for buf; either may be NULL
+void scan_block(const char *buf, size_t len, uint64_t *nl, uint64_t *ops);
+
+// Offset of the first marked byte at or after pos, len if none
+size_t scan_next(const uint64_t *mask, size_t len, size_t pos);
+
+// Version in use: "avx2", "sse2" or "scalar"
+const char* scan_impl();
+
+// Use the named version, false if this CPU lacks it
+bool scan_force(const char *name);
+
+#endif
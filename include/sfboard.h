@@ -0,0 +1,107 @@
+#ifndef SFBOARD_H
+#define SFBOARD_H
+
+// Job board: a shell running 'board on' publishes its job table in
+// /dev/shm/sfish-board-PID. Readers map the file once and copy slots out
+// under each slot's sequence count, with no calls into the shell.
+// Include this alone to read boards; it does not need sfish.h.
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define SFBOARD_MAGIC 0x44524253 // "SBRD"
+#define SFBOARD_VERSION 1
+#define SFBOARD_SLOTS 64
+#define SFBOARD_CMD 128
+#define SFBOARD_PATH "/dev/shm/sfish-board-%d"
+#define SFBOARD_TRIES 64
+
+enum sfboard_state {SFBOARD_FREE = 0, SFBOARD_RUNNING, SFBOARD_STOPPED, SFBOARD_DONE};
+
+// seq is odd while the shell rewrites the slot
+struct sfboard_slot {
+    uint32_t seq;
+    int32_t state;
+    int32_t jid;
+    int32_t pgid;
+    int32_t exit_status;    // Wait status once done
+    uint32_t pad;
+    uint64_t started;       // ns since the epoch
+    uint64_t updated;
+    uint64_t cpu_usec;      // From the job's cgroup, or its rusage once done
+    uint64_t mem_peak;      // Bytes
+    char cmd[SFBOARD_CMD];
+};
+
+struct sfboard {
+    uint32_t magic;         // Set once the rest of the header is
+    uint32_t version;
+    int32_t pid;
+    uint32_t nslots;
+    uint64_t gen;           // Bumped after every slot update
+    struct sfboard_slot slots[SFBOARD_SLOTS];
+};
+
+// Map the board of the shell with pid read-only, NULL if it has none
+static inline const struct sfboard* sfboard_map(pid_t pid) {
+    char path[64];
+    struct sfboard *board;
+    snprintf(path, sizeof(path), SFBOARD_PATH, (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    board = mmap(NULL, sizeof(struct sfboard), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (board == MAP_FAILED)
+        return NULL;
+    if (__atomic_load_n(&board->magic, __ATOMIC_ACQUIRE) != SFBOARD_MAGIC ||
+    board->version != SFBOARD_VERSION) {
+        munmap(board, sizeof(struct sfboard));
+        return NULL;
+    }
+    return board;
+}
+
+static inline void sfboard_unmap(const struct sfboard *board) {
+    munmap((void*)board, sizeof(struct sfboard));
+}
+
+// False once the shell has taken the board down; map it again to follow a
+// board the shell turned back on
+static inline bool sfboard_live(const struct sfboard *board) {
+    return __atomic_load_n(&board->magic, __ATOMIC_ACQUIRE) == SFBOARD_MAGIC;
+}
+
+// Copy a consistent slot into out, false if the shell kept rewriting it
+static inline bool sfboard_read(const struct sfboard_slot *slot, struct sfboard_slot *out) {
+    for (int i = 0; i < SFBOARD_TRIES; ++i) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(out, (const void*)slot, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            out->cmd[SFBOARD_CMD - 1] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copy every consistent, non-free slot into out, returning how many
+static inline int sfboard_snapshot(const struct sfboard *board, struct sfboard_slot *out) {
+    int n = 0;
+    for (int i = 0; i < SFBOARD_SLOTS; ++i) {
+        if (sfboard_read(&board->slots[i], &out[n]) && out[n].state != SFBOARD_FREE)
+            ++n;
+    }
+    return n;
+}
+
+#endif
@@ -1,8 +1,15 @@
 #ifndef SFISH_H
 #define SFISH_H
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <pthread.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <signal.h>
@@ -10,14 +17,27 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_ARGS 15
+#include "scan.h"
+#include "sfboard.h"
+
+#define ARGV_INIT 8
 #define TIME_SIZE 6
 
 enum colors {BLACK = 0, B_BLACK, RED, B_RED, GREEN, B_GREEN, 
@@ -43,67 +63,488 @@ char *open_tags[16] = {
 };
 
 char *HELP_MENU = "\nsfish bash, version 1-release (x86_64-pc-linux-gnu)\n\
+alias [NAME=CMD...] - run $CMD in place of $NAME, list aliases without args\n\
 bg [PID|JID] - resume stopped background job with $PID|$JID\n\
+board [on|off] - publish the job table in /dev/shm for sfboard\n\
 cd [] [-] [DIR] - change current directory\n\
+cgroup [on|off] - run each new job in its own cgroup v2 group\n\
 chclr [SETTING] [COLOR] [BOLD] - change color of prompt elements\n\
 chpmt [SETTING] [TOGGLE] - change display of prompt elements\n\
+coproc [NAME CMD] - run $CMD in the background on pipes reached by >&NAME and <&NAME\n\
+at DELAY CMD - run $CMD in the background after $DELAY (ms, s, m or h)\n\
 disown [PID|JID] - remove job with $PID|$JID from job list\n\
+every [-d ID] [INTERVAL CMD] - run $CMD in the background each $INTERVAL, -d cancels\n\
 exit - exit sfish\n\
+export [NAME[=VALUE]...] - export $NAME to commands, list exported without args\n\
+fds - list the shell's open file descriptors and what holds them\n\
 fg [PID|JID] - brings background job with $PID|$JID to foreground\n\
-jobs - print list of current jobs\n\
+jobs [-l] - print list of current jobs, -l with cgroup cpu, memory and io\n\
+history [N] [-s STR] - print last $N commands or those containing $STR\n\
+joblog [on [KIB]|off] [%JID] - capture background output, print $JID's log\n\
 kill [SIGNAL] [PID|JID] - send $SIGNAL to job with $PID|$JID\n\
+limit PID|JID [cpu=PCT] [mem=SIZE] [pids=N] - cap a cgroup job, max lifts a cap\n\
+NAME=VALUE... - set shell variable $NAME, used as $NAME or ${NAME}\n\
+NAME() { CMD; ... } - define function $NAME running each $CMD in sfish\n\
+pstat CMD - run $CMD and report performance counters per stage\n\
 pwd - print present working directory\n\
-prt - print last return value\n";
+prt - print last return value\n\
+xargs [-0] [-n N] [-P N] CMD - run $CMD on stdin items in ARG_MAX-sized batches\n\
+unset [-f] NAME... - remove variable $NAME, or function $NAME with -f\n\
+unalias NAME... - remove alias $NAME\n\
+wait [-n] [-t SECS] [PID|JID...] - wait for all or any of the jobs, for up to $SECS\n\
+trace [FILE|off] - write a Chrome trace of job timelines to $FILE\n\
+stats [-p] - print shell counters and latencies, -p in Prometheus format\n";
 
 char *INFO_MENU = \
 "\n----Info----\n\
 help\n\
+history\n\
 prt\n\
+stats\n\
+fds\n\
+trace\n\
 ----CTRL---\n\
 cd\n\
 chclr\n\
 chpmt\n\
 pwd\n\
 exit\n\
+export\n\
+unset\n\
+alias\n\
+unalias\n\
 ----Job Control----\n\
 bg\n\
 fg\n\
 disown\n\
 jobs\n\
+joblog\n\
+board\n\
+wait\n\
+cgroup\n\
+limit\n\
+every\n\
+at\n\
+coproc\n\
 kill\n\
+pstat\n\
+xargs\n\
 ---Number of Commands Run----\n";
 
 
+// Counters opened per stage by pstat, hardware first then software only
+#define PSTAT_NEVENTS 5
+
+struct pstat_event {
+    uint32_t type;
+    uint64_t config;
+    char *label;
+};
+
+struct pstat_event pstat_hw[PSTAT_NEVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock(ns)"}
+};
+
+struct pstat_event pstat_sw[PSTAT_NEVENTS] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock(ns)"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "ctx-switches"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "migrations"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ, "major-faults"}
+};
+
+// <(CMD) and >(CMD) arguments a stage may take
+#define PROCSUB_MAX 8
+
 struct exec {
     pid_t pid;
     int argc;
-    char *argv[MAX_ARGS];
+    char **argv;
+    char *path;
+    uint64_t forked;
     int srcfd;
     int desfd;
     int errfd;
+    int perf_fds[PSTAT_NEVENTS];
+    uint64_t counts[PSTAT_NEVENTS];
+    int nsub;
+    int sub_fds[PROCSUB_MAX];
+    pid_t sub_pids[PROCSUB_MAX];
     struct exec *next;
 };
 
+// Captured output of a background job, kept for a while after it exits
+#define JOBLOG_SIZE (64 << 10)
+#define JOBLOG_KEEP 16
+#define JOBLOG_READ (64 << 10)
+
+struct joblog {
+    int jid;
+    char *cmd;
+    int fd;
+    int wfd;
+    bool done;
+    char *buf;
+    size_t size;
+    size_t head;
+    size_t len;
+    struct joblog *next;
+};
+
+// Non-terminal stdin is read in chunks of at least this size. The commands
+// it runs share it, so no input past the line being run is kept from them:
+// a seekable stdin is rewound to the end of that line, a pipe is peeked at
+// with tee and only taken up to its next newline, and anything else is read
+// a byte at a time
+#define STDIN_READ (64 << 10)
+#define STDIN_PEEK 4096
+
+enum stdin_mode {STDIN_SEEK, STDIN_TEE, STDIN_BYTE};
+
+// ~/.sfishrc compiled to a cache: a header naming the rc file it was built
+// from, then entries of a type, a NUL-terminated name and a NUL-terminated
+// value, which is the whole line for commands
+#define RC_MAGIC 0x31435253 // "SRC1"
+
+enum rc_type {RC_CMD = 0, RC_FUNC, RC_ALIAS, RC_VAR, RC_EXPORT};
+
+struct rc_header {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+};
+
+struct rc_entry {
+    uint32_t type;
+    uint32_t name_len;
+    uint32_t value_len;
+};
+
+// Time spent in each startup phase, for --startup-profile
+#define STARTUP_PHASES 16
+
+struct startup_phase {
+    char *name;
+    uint64_t ns;
+};
+
+// Server mode: a session is one client connection, with its own cwd, $? and
+// stdio, the last three passed in as fds over the socket
+#define SERVER_BACKLOG 64
+#define SERVER_READ 4096
+
+struct session {
+    int sock;
+    int fds[3];         // Client's stdin, stdout and stderr, -1 until sent
+    int cwd_fd;
+    int last_fd;
+    char *cwd_path;
+    char *last_path;
+    int last_return;
+    pid_t wait_pid;     // Foreground job of the running request, 0 if none
+    char *pending;      // Rest of its command list, run once that job ends
+    char *buf;          // Requests read but not yet run, NUL-terminated
+    size_t len;
+    size_t cap;
+    bool closing;
+    struct session *next;
+};
+
+// Command substitution output is read in chunks of at least CMDSUB_READ / 2
+#define CMDSUB_READ (64 << 10)
+#define CMDSUB_PIPE_SIZE (1 << 20)
+
 struct job {
     int jid;
     pid_t pid;
     char *cmd;
     char *status;
     bool fg;
+    bool pstat;
+    struct pstat_event *events;
     int nexec;
     char time[TIME_SIZE];
+    uint64_t started;
+    struct joblog *log;
+    char *cgroup;       // Name under the shell's cgroup, NULL if none
+    int cgroup_fd;
+    int board_slot;     // Slot on the job board, -1 if none
+    char *coproc;       // Coprocess name, NULL if not one
+    int co_in;          // Shell's ends of its stdin and stdout
+    int co_out;
     struct exec *exec_head;
     struct job *next;
 };
 
+// Per-job cgroup v2 groups live under sfish-PID in the shell's own cgroup
+#define CGROUP_CONTROLLERS "cpu memory io pids"
+#define CGROUP_KILL_TIMEOUT_MS 200
+
 enum status {RUNNING = 0, STOPPED};
 char *exec_status[2] = {"Running", "Stopped"};
 
+// every/at timers, polled by the event loop; a tick is skipped while the
+// job launched by the previous one is still running
+struct timer {
+    int id;
+    int fd;
+    char *cmd;
+    char *interval;
+    bool repeat;
+    pid_t pid;
+    unsigned runs;
+    unsigned skipped;
+    struct timer *next;
+};
+
+// Wait statuses of recently finished background jobs, for wait
+#define JOBS_DONE_SIZE 64
+
+struct job_done {
+    int jid;
+    pid_t pid;
+    int status;
+};
+
+// History log: append-only records, each followed by a copy of its length
+// so the log can be walked backwards
+#define HIST_MAGIC 0x31484653 // "SFH1"
+#define HIST_IDX_MAGIC 0x31494653 // "SFI1"
+#define HIST_LOG_INIT (1 << 20)
+#define HIST_BUCKETS (1 << 16)
+#define HIST_BLOCK_IDS 30
+#define HIST_MEM_MAX 1000
+#define HIST_DEDUP_SLOTS 4096
+#define HIST_SEEN_MAX 256
+
+struct hist_file {
+    int fd;
+    size_t size;
+    char *map;
+};
+
+struct hist_header {
+    uint32_t magic;
+    uint32_t nentries;
+    uint64_t used;
+};
+
+struct hist_entry {
+    uint32_t len;
+    int32_t status;
+    int64_t start;
+    uint64_t ref;       // Offset of the entry holding the text
+    uint32_t duration;  // Milliseconds
+    uint16_t cwd_len;
+    uint16_t cmd_len;   // 0 when the text lives in ref
+};
+
+// Trigram index: bucket heads followed by chained posting blocks
+struct hist_idx_header {
+    uint32_t magic;
+    uint32_t nbuckets;
+    uint64_t used;
+    uint64_t indexed;   // Log offset indexed up to
+};
+
+struct hist_bucket {
+    uint64_t head;
+    uint32_t count;
+    uint32_t pad;
+};
+
+struct hist_block {
+    uint64_t prev;
+    uint32_t n;
+    uint32_t pad;
+    uint64_t offs[HIST_BLOCK_IDS];
+};
+
+struct hist_dedup {
+    uint64_t hash;
+    uint64_t off;
+};
+
+// Parsed command lines cached by their raw text, revalidated against the
+// cwd, the PATH generation and the mtimes of resolved executables
+#define PARSE_CACHE_SIZE 128
+#define PARSE_CACHE_BUCKETS 256
+
+// Here-documents keep their body in file once parsed
+enum redir_type {REDIR_IN = 0, REDIR_OUT, REDIR_APPEND, REDIR_ERR, REDIR_HEREDOC,
+REDIR_HERESTR, REDIR_COIN, REDIR_COOUT};
+
+struct redir {
+    enum redir_type type;
+    char *file;
+    struct redir *next;
+};
+
+struct stage {
+    int argc;
+    char **argv;
+    char *path;
+    struct timespec mtime;
+    ino_t ino;
+    struct redir *redirs;
+    struct stage *next;
+};
+
+struct parsed {
+    char *line;
+    uint64_t hash;
+    bool fg;
+    bool pstat;
+    int nstage;
+    char *cwd;
+    unsigned path_gen;
+    struct stage *stages;
+    struct parsed *prev;    // LRU order, newest first
+    struct parsed *next;
+    struct parsed *chain;   // Hash bucket
+};
+
+// Shell variables, exported ones make up the envp of launched commands
+#define VAR_BUCKETS 256
+
+struct var {
+    char *name;
+    char *value;
+    bool exported;
+    struct var *next;
+};
+
+// Glob patterns compile to one token list per path component, matched
+// against directory listings read with getdents64 and cached for a short
+// while, revalidated against the directory's mtime
+#define GLOB_DENTS_SIZE (1 << 20)
+#define GLOB_CACHE_SIZE 8
+#define GLOB_CACHE_TTL_NS 2000000000ULL
+
+enum glob_type {G_CHAR = 0, G_ANY, G_STAR, G_CLASS};
+
+struct glob_tok {
+    enum glob_type type;
+    char c;
+    uint8_t set[32];
+};
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct glob_ent {
+    char *name;
+    unsigned char type;
+};
+
+struct glob_dir {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t loaded;
+    int nents;
+    struct glob_ent *ents;
+    char *names;
+    struct glob_dir *next;
+};
+
+// Resolved PATH lookups, flushed whenever PATH changes
+#define PATH_CACHE_SIZE 64
+
+struct path_ent {
+    char *name;
+    char *path;
+    struct path_ent *next;
+};
+
+// Metrics live in a shared mapping so job processes can record into it.
+// Latencies are nanoseconds in log-linear buckets: 2^LAT_SUB_BITS per
+// power of two, bounding the relative error to 1/2^LAT_SUB_BITS.
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+enum metric {M_COMMANDS = 0, M_FORKS, M_EXECS, M_PATH_HITS, M_PATH_MISSES,
+M_PARSE_HITS, M_PARSE_MISSES, M_GLOB_HITS, M_GLOB_MISSES, M_SIGCHLDS, NMETRICS};
+char *metric_names[NMETRICS] = {"commands", "forks", "execs", "path_cache_hits",
+"path_cache_misses", "parse_cache_hits", "parse_cache_misses", "glob_cache_hits",
+"glob_cache_misses", "sigchlds"};
+char *metric_help[NMETRICS] = {"Command lines evaluated.", "Processes forked.",
+"Programs exec'd.", "PATH lookups served from the cache.",
+"PATH lookups that scanned PATH.", "Command lines served from the parse cache.",
+"Command lines parsed from scratch.", "Glob directory reads served from the cache.",
+"Glob directory reads that scanned the directory.", "SIGCHLD signals handled."};
+
+enum latency {L_PARSE = 0, L_LAUNCH, L_JOB, NLATENCIES};
+char *latency_names[NLATENCIES] = {"parse", "launch", "job"};
+char *latency_help[NLATENCIES] = {"Time to parse a command line into a job.",
+"Time from fork to exec of a job stage.", "Lifetime of a job from fork to reap."};
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+struct metrics {
+    uint64_t counters[NMETRICS];
+    struct lat_hist lat[NLATENCIES];
+};
+
+// Trace events are queued by every job process in a shared bounded ring
+// (per-slot sequence numbers) and drained to JSON by a writer thread
+#define TRACE_RING_SIZE 4096
+#define TRACE_NAME_SIZE 16
+#define TRACE_ARG_SIZE 48
+#define TRACE_FLUSH_NS 20000000
+
+struct trace_event {
+    uint64_t seq;
+    uint64_t ts;
+    uint64_t dur;
+    pid_t tid;
+    char ph;
+    char name[TRACE_NAME_SIZE];
+    char arg[TRACE_ARG_SIZE];
+};
+
+struct trace_ring {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
 struct builtin {
-    char label[5];
-    int(func*)(int, char**);
+    char *name;
+    int (*func)(int, char**);
+    bool mproc;     // Runs in the shell process
+};
+
+// Functions and aliases, looked up after the builtins
+#define FUNC_BUCKETS 64
+#define FUNC_DEPTH_MAX 64
+#define ALIAS_DEPTH_MAX 16
+
+struct shfunc {
+    char *name;
+    char *body;
+    struct shfunc *next;
 };
-struct builtin builtins[12];
 
 #endif
 
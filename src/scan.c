@@ -0,0 +1,174 @@
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+enum {SCAN_NL = 1, SCAN_OP = 2};
+
+static const uint8_t scan_class[256] = {
+    ['\n'] = SCAN_NL, [' '] = SCAN_OP, ['\t'] = SCAN_OP, ['|'] = SCAN_OP,
+    ['<'] = SCAN_OP, ['>'] = SCAN_OP, ['&'] = SCAN_OP, [';'] = SCAN_OP,
+    ['('] = SCAN_OP, [')'] = SCAN_OP, ['$'] = SCAN_OP, ['"'] = SCAN_OP,
+    ['\''] = SCAN_OP
+};
+
+// Bytes from start on, which begin a mask word, one at a time
+static void scan_tail(const char *buf, size_t start, size_t len, uint64_t *nl,
+uint64_t *ops) {
+    for (size_t w = start / 64; w < SCAN_WORDS(len); ++w) {
+        if (nl != NULL)
+            nl[w] = 0;
+        if (ops != NULL)
+            ops[w] = 0;
+    }
+    for (size_t i = start; i < len; ++i) {
+        uint8_t class = scan_class[(uint8_t)buf[i]];
+        if ((class & SCAN_NL) && nl != NULL)
+            nl[i / 64] |= 1ULL << (i % 64);
+        if ((class & SCAN_OP) && ops != NULL)
+            ops[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+static void scan_scalar(const char *buf, size_t len, uint64_t *nl, uint64_t *ops) {
+    scan_tail(buf, 0, len, nl, ops);
+}
+
+#ifdef SCAN_X86
+// Sixteen bytes compared against each byte of the set
+__attribute__((target("sse2")))
+static inline void scan_sse2_16(__m128i v, uint32_t *nl, uint32_t *ops) {
+    __m128i hit = _mm_setzero_si128();
+    for (const char *op = SCAN_OPS; *op != '\0'; ++op)
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(*op)));
+    *nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    *ops = _mm_movemask_epi8(hit);
+}
+
+__attribute__((target("sse2")))
+static void scan_sse2(const char *buf, size_t len, uint64_t *nl, uint64_t *ops) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t nl_word = 0, ops_word = 0;
+        for (int j = 0; j < 4; ++j) {
+            uint32_t nl_bits, ops_bits;
+            scan_sse2_16(_mm_loadu_si128((const __m128i*)(buf + i + j * 16)), 
+            &nl_bits, &ops_bits);
+            nl_word |= (uint64_t)nl_bits << (j * 16);
+            ops_word |= (uint64_t)ops_bits << (j * 16);
+        }
+        if (nl != NULL)
+            nl[i / 64] = nl_word;
+        if (ops != NULL)
+            ops[i / 64] = ops_word;
+    }
+    scan_tail(buf, i, len, nl, ops);
+}
+
+// Each set byte is picked out by a bit shared between a table of its low
+// nibble and a table of its high one: bit 0 tab, bit 1 newline, bit 2 the
+// 0x2_ operators, bit 3 the 0x3_ ones and bit 4 '|'
+#define SCAN_LO_TAB \
+    4, 0, 4, 0, 4, 0, 4, 4, 4, 5, 2, 8, 24, 0, 8, 0
+#define SCAN_HI_TAB \
+    3, 0, 4, 8, 0, 0, 0, 16, 0, 0, 0, 0, 0, 0, 0, 0
+
+__attribute__((target("avx2")))
+static inline void scan_avx2_32(__m256i v, uint32_t *nl, uint32_t *ops) {
+    const __m256i lo_tab = _mm256_setr_epi8(SCAN_LO_TAB, SCAN_LO_TAB);
+    const __m256i hi_tab = _mm256_setr_epi8(SCAN_HI_TAB, SCAN_HI_TAB);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i class = _mm256_and_si256(_mm256_shuffle_epi8(lo_tab, lo), 
+    _mm256_shuffle_epi8(hi_tab, hi));
+    __m256i nl_bit = _mm256_set1_epi8(2);
+    *nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(class, nl_bit), nl_bit));
+    *ops = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_andnot_si256(nl_bit, class),
+    _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(const char *buf, size_t len, uint64_t *nl, uint64_t *ops) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint32_t nl_lo, ops_lo, nl_hi, ops_hi;
+        scan_avx2_32(_mm256_loadu_si256((const __m256i*)(buf + i)), &nl_lo, &ops_lo);
+        scan_avx2_32(_mm256_loadu_si256((const __m256i*)(buf + i + 32)), &nl_hi, &ops_hi);
+        if (nl != NULL)
+            nl[i / 64] = (uint64_t)nl_hi << 32 | nl_lo;
+        if (ops != NULL)
+            ops[i / 64] = (uint64_t)ops_hi << 32 | ops_lo;
+    }
+    scan_tail(buf, i, len, nl, ops);
+}
+#endif
+
+static void (*scan_fn)(const char*, size_t, uint64_t*, uint64_t*);
+static const char *scan_name;
+
+static void scan_pick() {
+    scan_fn = scan_scalar;
+    scan_name = "scalar";
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_fn = scan_avx2;
+        scan_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_fn = scan_sse2;
+        scan_name = "sse2";
+    }
+#endif
+}
+
+void scan_block(const char *buf, size_t len, uint64_t *nl, uint64_t *ops) {
+    if (scan_fn == NULL)
+        scan_pick();
+    scan_fn(buf, len, nl, ops);
+}
+
+size_t scan_next(const uint64_t *mask, size_t len, size_t pos) {
+    if (pos >= len)
+        return len;
+    size_t w = pos / 64;
+    uint64_t bits = mask[w] & (~0ULL << (pos % 64));
+    while (bits == 0) {
+        if (++w >= SCAN_WORDS(len))
+            return len;
+        bits = mask[w];
+    }
+    pos = w * 64 + __builtin_ctzll(bits);
+    return pos < len ? pos : len;
+}
+
+const char* scan_impl() {
+    if (scan_fn == NULL)
+        scan_pick();
+    return scan_name;
+}
+
+bool scan_force(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        scan_fn = scan_scalar;
+        scan_name = "scalar";
+        return true;
+    }
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        scan_fn = scan_sse2;
+        scan_name = "sse2";
+        return true;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        scan_fn = scan_avx2;
+        scan_name = "avx2";
+        return true;
+    }
+#endif
+    return false;
+}
@@ -3,24 +3,118 @@
 #define MAX_EXECS 10
 #define PROMPT_SIZE 256
 #define HOSTNAME_SIZE 112
-#define PWD_SIZE 160
 #define CLOSE_TAG "\x1b[0m"
 
 // Environment variables
 struct job *jobs_head;
-char last_dir[256];
+int cwd_fd = -1;
+int last_fd = -1;
+char *cwd_path;
+char *last_path;
 int last_return;
+struct job_done jobs_done[JOBS_DONE_SIZE];
+int jobs_done_next;
 int cmd_count;
 pid_t stored_pid;
+pid_t shell_pid;
 
 // Prompt settings
-char *user;
 char *user_color = "\e[0;37m"; // Default white non-bold
 char *machine;
 char *machine_color = "\e[0;37m"; // Default white non-bold
 char *pwd;
 bool user_tag = false;
 bool mach_tag = false;
+char *prompt;
+
+// Event loop
+bool running = true;
+bool interactive;                   // stdin is a terminal, read through readline
+char *stdin_buf;
+size_t stdin_len, stdin_cap;
+enum stdin_mode stdin_mode;
+int stdin_peek[2] = {-1, -1};
+struct startup_phase startup_phases[STARTUP_PHASES];
+int startup_nphases;
+uint64_t startup_last;
+char *heredoc_text;
+char **heredoc_delims;
+int heredoc_ndelim, heredoc_next;
+struct timer *timers_head;
+int timer_next_id;
+
+// Server mode
+int server_fd = -1;
+struct session *sessions_head;
+struct session *server_session;     // Session whose request is running
+
+// cgroups
+bool cgroup_on;
+int cgroup_root = -1;
+int cgroup_home = -1;               // Group the shell started in
+char cgroup_added[256];             // Controllers the shell enabled there
+pid_t cgroup_owner;
+unsigned cgroup_seq;
+
+// Job board, the job table published for external monitors
+struct sfboard *board;
+pid_t board_owner;
+char board_path[64];
+
+// Background output capture
+struct joblog *joblogs_head;
+bool joblog_on;
+size_t joblog_size = JOBLOG_SIZE;
+
+// History
+struct hist_file hist_log = {-1, 0, NULL};
+struct hist_file hist_idx = {-1, 0, NULL};
+struct hist_dedup hist_dedup[HIST_DEDUP_SLOTS];
+
+// fd registry, owner of each fd the shell keeps open
+char **fd_owners;
+int fd_owners_cap;
+
+// Metrics
+struct metrics *metrics;
+int metrics_fd = -1;
+pid_t metrics_owner;
+char metrics_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+// Tracing
+struct trace_ring *trace_ring;
+bool tracing;
+pid_t trace_pid;
+FILE *trace_out;
+pthread_t trace_thread;
+
+// PATH cache
+struct path_ent *path_cache[PATH_CACHE_SIZE];
+char *path_cache_env;
+unsigned path_cache_gen;
+
+// Variables
+struct var *vars[VAR_BUCKETS];
+char **var_envp;
+bool var_envp_stale = true;
+
+// Functions and aliases
+struct shfunc *funcs[FUNC_BUCKETS];
+struct shfunc *aliases[FUNC_BUCKETS];
+char **func_argv;
+int func_argc;
+int func_depth;
+
+// Raw text of the command line a main process builtin runs from
+char *builtin_input;
+
+// Glob directory cache
+struct glob_dir *glob_cache;
+
+// Parse cache
+struct parsed *parse_cache[PARSE_CACHE_BUCKETS];
+struct parsed *parse_lru_head, *parse_lru_tail;
+int parse_cache_count;
 
 char *var_cat(char *buf, int nvar, ...) {
     va_list vars;
@@ -32,6 +126,15 @@ char *var_cat(char *buf, int nvar, ...) {
     return buf;
 }
 
+uint64_t str_hash(char *str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *str != '\0'; ++str) {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 void s_print(int fd, const char *format, int nvar, ...) {
     // Count vars in format
     int i = 0, j;
@@ -58,8 +161,9 @@ void s_print(int fd, const char *format, int nvar, ...) {
                     numcpy /= 10;
                     ++numlen;
                 }
-                char numstr[numlen + 1];
-                memset(numstr, 0, numlen + 1);
+                // Room for "0" and its terminator
+                char numstr[numlen + 2];
+                memset(numstr, 0, numlen + 2);
                 if (num == 0) {
                     numstr[0] = '0';
                 }
@@ -85,18 +189,684 @@ void s_print(int fd, const char *format, int nvar, ...) {
     write(fd, str, strlen(str));
 }
 
+// Record owner as holding fd, or forget fd with a NULL owner
+int fd_track(int fd, char *owner) {
+    if (fd < 0)
+        return fd;
+    if (fd >= fd_owners_cap) {
+        int cap = fd_owners_cap;
+        while (fd >= fd_owners_cap)
+            fd_owners_cap = fd_owners_cap == 0 ? 64 : fd_owners_cap << 1;
+        fd_owners = realloc(fd_owners, fd_owners_cap * sizeof(char*));
+        memset(fd_owners + cap, 0, (fd_owners_cap - cap) * sizeof(char*));
+    }
+    fd_owners[fd] = owner;
+    return fd;
+}
+
+void fd_close(int fd) {
+    if (fd < 0)
+        return;
+    fd_track(fd, NULL);
+    close(fd);
+}
+
+// Clear the way to bind a socket at path, removing only a stale socket
+bool sock_clear(char *path) {
+    struct stat stats;
+    if (lstat(path, &stats) == -1)
+        return errno == ENOENT;
+    return S_ISSOCK(stats.st_mode) && unlink(path) == 0;
+}
+
+// List the shell's open fds; untracked ones past stdio are leaks
+int sf_fds(int argc, char **argv) {
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *ent;
+    int fd, nfds = 0;
+    if (dir == NULL) {
+        s_print(STDERR_FILENO, "fds: cannot read /proc/self/fd\n", 0);
+        return 1;
+    }
+    int fds[FD_SETSIZE];
+    while ((ent = readdir(dir)) != NULL && nfds < FD_SETSIZE) {
+        if (ent->d_name[0] != '.' && (fd = atoi(ent->d_name)) != dirfd(dir))
+            fds[nfds++] = fd;
+    }
+    closedir(dir);
+    for (int i = 0; i < nfds; ++i) {
+        fd = fds[i];
+        s_print(STDOUT_FILENO, "%d    %s\n", 2, fd, fd < 3 ? "stdio" : 
+        fd < fd_owners_cap && fd_owners[fd] != NULL ? fd_owners[fd] : "untracked");
+    }
+    return 0;
+}
+
+// Exit code of a wait status, as $? reports it
+int exit_code(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+struct var* var_find(char *name) {
+    struct var *cursor = vars[str_hash(name) % VAR_BUCKETS];
+    while (cursor != NULL && strcmp(cursor->name, name) != 0)
+        cursor = cursor->next;
+    return cursor;
+}
+
+char* var_get(char *name) {
+    struct var *var = var_find(name);
+    return var != NULL ? var->value : NULL;
+}
+
+// Set name to value, keeping its export flag unless export is set
+void var_set(char *name, char *value, bool export) {
+    struct var *var = var_find(name);
+    if (var == NULL) {
+        unsigned hash = str_hash(name) % VAR_BUCKETS;
+        var = calloc(1, sizeof(struct var));
+        var->name = strdup(name);
+        var->next = vars[hash];
+        vars[hash] = var;
+    }
+    if (value != NULL) {
+        free(var->value);
+        var->value = strdup(value);
+    } else if (var->value == NULL) {
+        var->value = strdup("");
+    }
+    var->exported |= export;
+    var_envp_stale |= var->exported;
+}
+
+void var_unset(char *name) {
+    struct var **cursor = &vars[str_hash(name) % VAR_BUCKETS], *var;
+    while (*cursor != NULL && strcmp((*cursor)->name, name) != 0)
+        cursor = &(*cursor)->next;
+    if ((var = *cursor) == NULL)
+        return;
+    *cursor = var->next;
+    var_envp_stale |= var->exported;
+    free(var->name);
+    free(var->value);
+    free(var);
+}
+
+// Length of the variable name starting str, 0 if it does not start one
+int var_name_len(char *str) {
+    int len = 0;
+    if (*str != '_' && (*str < 'A' || (*str > 'Z' && *str < 'a') || *str > 'z'))
+        return 0;
+    while (str[len] == '_' || (str[len] >= '0' && str[len] <= '9') ||
+    (str[len] >= 'A' && str[len] <= 'Z') || (str[len] >= 'a' && str[len] <= 'z'))
+        ++len;
+    return len;
+}
+
+// Environment for exec, only rebuilt after an exported variable changes
+char** var_environ() {
+    if (!var_envp_stale)
+        return var_envp;
+    if (var_envp != NULL) {
+        for (char **env = var_envp; *env != NULL; ++env)
+            free(*env);
+        free(var_envp);
+    }
+    int count = 0;
+    for (int i = 0; i < VAR_BUCKETS; ++i)
+        for (struct var *var = vars[i]; var != NULL; var = var->next)
+            count += var->exported;
+    var_envp = calloc(count + 1, sizeof(char*));
+    count = 0;
+    for (int i = 0; i < VAR_BUCKETS; ++i) {
+        for (struct var *var = vars[i]; var != NULL; var = var->next) {
+            if (!var->exported)
+                continue;
+            var_envp[count] = calloc(strlen(var->name) + strlen(var->value) + 2, 1);
+            var_cat(var_envp[count++], 3, var->name, "=", var->value);
+        }
+    }
+    var_envp_stale = false;
+    return var_envp;
+}
+
+void var_init() {
+    for (char **env = environ; *env != NULL; ++env) {
+        char *eq = strchr(*env, '=');
+        if (eq == NULL || var_name_len(*env) != eq - *env)
+            continue;
+        char name[eq - *env + 1];
+        strncpy(name, *env, eq - *env);
+        name[eq - *env] = '\0';
+        var_set(name, eq + 1, true);
+    }
+}
+
+// Expand $NAME, ${NAME}, $? and function arguments $1-$9 and $# in word;
+// values are not split again
+char* var_expand(char *word) {
+    size_t len = 0, size = strlen(word) + 64;
+    char *expanded = malloc(size), *value, status[16];
+    while (*word != '\0') {
+        int name_len = 0;
+        bool braced = word[0] == '$' && word[1] == '{';
+        value = NULL;
+        if (word[0] == '$' && word[1] == '?') {
+            snprintf(status, sizeof(status), "%d", exit_code(last_return));
+            value = status;
+            name_len = 1;
+        } else if (word[0] == '$' && word[1] == '#') {
+            snprintf(status, sizeof(status), "%d", func_argc);
+            value = status;
+            name_len = 1;
+        } else if (word[0] == '$' && word[1] >= '1' && word[1] <= '9') {
+            value = word[1] - '0' <= func_argc ? func_argv[word[1] - '0' - 1] : "";
+            name_len = 1;
+        } else if (word[0] == '$' && (name_len = var_name_len(word + 1 + braced)) > 0 &&
+        (!braced || word[2 + name_len] == '}')) {
+            char name[name_len + 1];
+            strncpy(name, word + 1 + braced, name_len);
+            name[name_len] = '\0';
+            if ((value = var_get(name)) == NULL)
+                value = "";
+            name_len += braced << 1;
+        } else {
+            name_len = 0;
+        }
+        size_t value_len = name_len > 0 ? strlen(value) : 1;
+        if (len + value_len + 1 > size)
+            expanded = realloc(expanded, size = (len + value_len + 1) << 1);
+        if (name_len > 0) {
+            memcpy(expanded + len, value, value_len);
+            word += name_len + 1;
+        } else {
+            expanded[len] = *word++;
+        }
+        len += value_len;
+    }
+    expanded[len] = '\0';
+    return expanded;
+}
+
+char* var_word(char *word) {
+    return strchr(word, '$') != NULL ? var_expand(word) : strdup(word);
+}
+
+int sf_export(int argc, char **argv) {
+    if (argc == 1) {
+        for (char **env = var_environ(); *env != NULL; ++env)
+            dprintf(STDOUT_FILENO, "export %s\n", *env);
+        return 0;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; ++i) {
+        int len = var_name_len(argv[i]);
+        if (len == 0 || (argv[i][len] != '=' && argv[i][len] != '\0')) {
+            s_print(STDERR_FILENO, "export: '%s': Invalid input\n", 1, argv[i]);
+            ret = 1;
+            continue;
+        }
+        char name[len + 1];
+        strncpy(name, argv[i], len);
+        name[len] = '\0';
+        var_set(name, argv[i][len] == '=' ? argv[i] + len + 1 : NULL, true);
+    }
+    return ret;
+}
+
+struct shfunc* shfunc_find(struct shfunc **table, char *name) {
+    struct shfunc *cursor = table[str_hash(name) % FUNC_BUCKETS];
+    while (cursor != NULL && strcmp(cursor->name, name) != 0)
+        cursor = cursor->next;
+    return cursor;
+}
+
+void shfunc_set(struct shfunc **table, char *name, char *body) {
+    struct shfunc *shfunc = shfunc_find(table, name);
+    if (shfunc == NULL) {
+        unsigned hash = str_hash(name) % FUNC_BUCKETS;
+        shfunc = calloc(1, sizeof(struct shfunc));
+        shfunc->name = strdup(name);
+        shfunc->next = table[hash];
+        table[hash] = shfunc;
+    }
+    free(shfunc->body);
+    shfunc->body = body;
+}
+
+bool shfunc_unset(struct shfunc **table, char *name) {
+    struct shfunc **cursor = &table[str_hash(name) % FUNC_BUCKETS], *shfunc;
+    while (*cursor != NULL && strcmp((*cursor)->name, name) != 0)
+        cursor = &(*cursor)->next;
+    if ((shfunc = *cursor) == NULL)
+        return false;
+    *cursor = shfunc->next;
+    free(shfunc->name);
+    free(shfunc->body);
+    free(shfunc);
+    return true;
+}
+
+int sf_unset(int argc, char **argv) {
+    bool func = argc > 1 && strcmp(argv[1], "-f") == 0;
+    for (int i = 1 + func; i < argc; ++i) {
+        // Parsed commands may have resolved to the function
+        if (func && shfunc_unset(funcs, argv[i]))
+            ++path_cache_gen;
+        else if (!func)
+            var_unset(argv[i]);
+    }
+    return 0;
+}
+
+int sf_unalias(int argc, char **argv) {
+    int ret = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!shfunc_unset(aliases, argv[i])) {
+            s_print(STDERR_FILENO, "unalias: %s: not found\n", 1, argv[i]);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+// NAME=VALUE words run as a command
+bool var_is_assign(char *word) {
+    int len = var_name_len(word);
+    return len > 0 && word[len] == '=';
+}
+
+int sf_assign(int argc, char **argv) {
+    for (int i = 0; i < argc; ++i) {
+        if (!var_is_assign(argv[i])) {
+            s_print(STDERR_FILENO, "%s: Invalid input\n", 1, argv[i]);
+            return 1;
+        }
+    }
+    for (int i = 0; i < argc; ++i) {
+        int len = var_name_len(argv[i]);
+        char name[len + 1];
+        strncpy(name, argv[i], len);
+        name[len] = '\0';
+        var_set(name, argv[i] + len + 1, false);
+    }
+    return 0;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metric_inc(enum metric m) {
+    __atomic_fetch_add(&metrics->counters[m], 1, __ATOMIC_RELAXED);
+}
+
+int lat_bucket(uint64_t val) {
+    if (val < LAT_SUB)
+        return val;
+    int shift = 63 - __builtin_clzll(val) - LAT_SUB_BITS;
+    return ((shift + 1) << LAT_SUB_BITS) + ((val >> shift) & (LAT_SUB - 1));
+}
+
+uint64_t lat_bucket_max(int bucket) {
+    if (bucket < LAT_SUB)
+        return bucket;
+    int shift = (bucket >> LAT_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)(LAT_SUB + (bucket & (LAT_SUB - 1))) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+void lat_record(enum latency l, uint64_t val) {
+    struct lat_hist *hist = &metrics->lat[l];
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, val, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->buckets[lat_bucket(val)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (val > max && !__atomic_compare_exchange_n(&hist->max, &max, val,
+    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t lat_percentile(struct lat_hist *hist, double q) {
+    uint64_t rank = q * hist->count + 0.5, seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (int i = 0; i < LAT_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+            return lat_bucket_max(i) < hist->max ? lat_bucket_max(i) : hist->max;
+    }
+    return hist->max;
+}
+
+void metrics_prom(int fd) {
+    static double bounds[] = {1e-6, 5e-6, 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3,
+    1e-2, 5e-2, 0.1, 0.5, 1, 5, 10, 60};
+    int nbounds = sizeof(bounds) / sizeof(double);
+    for (int m = 0; m < NMETRICS; ++m) {
+        dprintf(fd, "# HELP sfish_%s_total %s\n# TYPE sfish_%s_total counter\n"
+        "sfish_%s_total %lu\n", metric_names[m], metric_help[m], metric_names[m],
+        metric_names[m], metrics->counters[m]);
+    }
+    for (int l = 0; l < NLATENCIES; ++l) {
+        struct lat_hist *hist = &metrics->lat[l];
+        char *name = latency_names[l];
+        dprintf(fd, "# HELP sfish_%s_seconds %s\n# TYPE sfish_%s_seconds "
+        "histogram\n", name, latency_help[l], name);
+        // Fold the fine buckets into cumulative exposition buckets
+        uint64_t cumulative = 0;
+        int i = 0;
+        for (int b = 0; b < nbounds; ++b) {
+            for (; i < LAT_BUCKETS && lat_bucket_max(i) <= bounds[b] * 1e9; ++i)
+                cumulative += hist->buckets[i];
+            dprintf(fd, "sfish_%s_seconds_bucket{le=\"%g\"} %lu\n", name,
+            bounds[b], cumulative);
+        }
+        dprintf(fd, "sfish_%s_seconds_bucket{le=\"+Inf\"} %lu\n"
+        "sfish_%s_seconds_sum %.9f\nsfish_%s_seconds_count %lu\n", name,
+        hist->count, name, hist->sum / 1e9, name, hist->count);
+    }
+}
+
+int sf_stats(int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "-p") == 0) {
+        metrics_prom(STDOUT_FILENO);
+        return 0;
+    } else if (argc != 1) {
+        s_print(STDERR_FILENO, "stats: Invalid input\n", 0);
+        return 1;
+    }
+    for (int m = 0; m < NMETRICS; ++m) {
+        dprintf(STDOUT_FILENO, "%-18s %lu\n", metric_names[m],
+        metrics->counters[m]);
+    }
+    dprintf(STDOUT_FILENO, "\n%-8s %8s %10s %10s %10s %10s %10s\n", "latency",
+    "count", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+    for (int l = 0; l < NLATENCIES; ++l) {
+        struct lat_hist *hist = &metrics->lat[l];
+        dprintf(STDOUT_FILENO, "%-8s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+        latency_names[l], hist->count,
+        hist->count ? hist->sum / 1e3 / hist->count : 0.0,
+        lat_percentile(hist, 0.5) / 1e3, lat_percentile(hist, 0.9) / 1e3,
+        lat_percentile(hist, 0.99) / 1e3, hist->max / 1e3);
+    }
+    return 0;
+}
+
+// Answer one scraper; the shell polls the socket with its other fds
+void metrics_accept() {
+    int cfd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (cfd == -1)
+        return;
+    // Answer HTTP scrapers with a header, plain readers with the body
+    char req[512];
+    struct pollfd pfd = {cfd, POLLIN, 0};
+    bool http = false;
+    if (poll(&pfd, 1, 100) > 0) {
+        ssize_t n = read(cfd, req, sizeof(req));
+        http = n >= 4 && strncmp(req, "GET ", 4) == 0;
+    }
+    if (http) {
+        dprintf(cfd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+        "version=0.0.4\r\n\r\n");
+    }
+    metrics_prom(cfd);
+    close(cfd);
+}
+
+void metrics_cleanup() {
+    // Children inherit the atexit handler
+    if (getpid() == metrics_owner)
+        unlink(metrics_path);
+}
+
+void metrics_init() {
+    metrics = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, 
+    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED)
+        metrics = calloc(1, sizeof(struct metrics));
+
+    // Serve Prometheus text on the socket named by SFISH_METRICS_SOCKET
+    char *path = var_get("SFISH_METRICS_SOCKET");
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path))
+        return;
+    strcpy(addr.sun_path, path);
+    if (!sock_clear(path) ||
+    fd_track(metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), 
+    "metrics") == -1 ||
+    bind(metrics_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+    listen(metrics_fd, 16) == -1) {
+        s_print(STDERR_FILENO, "sfish: metrics socket '%s' unavailable\n", 1, path);
+        return;
+    }
+    strcpy(metrics_path, path);
+    metrics_owner = getpid();
+    atexit(metrics_cleanup);
+}
+
+void trace_event(char ph, char *name, char *arg, uint64_t ts, uint64_t dur) {
+    if (!tracing)
+        return;
+    struct trace_event *event;
+    uint64_t pos = __atomic_load_n(&trace_ring->head, __ATOMIC_RELAXED);
+    // Claim a free slot, dropping the event when the writer is behind
+    for (;;) {
+        event = &trace_ring->events[pos % TRACE_RING_SIZE];
+        int64_t diff = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) - pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&trace_ring->head, &pos, pos + 1,
+            false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&trace_ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&trace_ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    event->ts = ts;
+    event->dur = dur;
+    event->tid = getpid();
+    event->ph = ph;
+    strncpy(event->name, name, TRACE_NAME_SIZE - 1);
+    event->name[TRACE_NAME_SIZE - 1] = '\0';
+    strncpy(event->arg, arg != NULL ? arg : "", TRACE_ARG_SIZE - 1);
+    event->arg[TRACE_ARG_SIZE - 1] = '\0';
+    __atomic_store_n(&event->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void trace_instant(char *name, char *arg) {
+    trace_event('i', name, arg, now_ns(), 0);
+}
+
+void trace_span(char *name, char *arg, uint64_t start) {
+    trace_event('X', name, arg, start, now_ns() - start);
+}
+
+void trace_json_str(char *str) {
+    for (; *str != '\0'; ++str) {
+        if (*str == '"' || *str == '\\')
+            fprintf(trace_out, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(trace_out, "\\u%04x", *str);
+        else
+            fputc(*str, trace_out);
+    }
+}
+
+void trace_drain() {
+    struct trace_event *event;
+    uint64_t pos = trace_ring->tail;
+    for (;; ++pos) {
+        event = &trace_ring->events[pos % TRACE_RING_SIZE];
+        if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+        // Thread names label each process row with the program it runs
+        if (strcmp(event->name, "exec") == 0) {
+            fprintf(trace_out, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":"
+            "%d,\"tid\":%d,\"args\":{\"name\":\"", trace_pid, event->tid);
+            trace_json_str(event->arg);
+            fprintf(trace_out, " (%d)\"}}", event->tid);
+        }
+        fprintf(trace_out, ",\n{\"ph\":\"%c\",\"name\":\"", event->ph);
+        trace_json_str(event->name);
+        fprintf(trace_out, "\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", trace_pid,
+        event->tid, event->ts / 1e3);
+        if (event->ph == 'X')
+            fprintf(trace_out, ",\"dur\":%.3f", event->dur / 1e3);
+        else
+            fprintf(trace_out, ",\"s\":\"t\"");
+        fprintf(trace_out, ",\"args\":{\"arg\":\"");
+        trace_json_str(event->arg);
+        fprintf(trace_out, "\"}}");
+        __atomic_store_n(&event->seq, pos + TRACE_RING_SIZE, __ATOMIC_RELEASE);
+    }
+    trace_ring->tail = pos;
+    fflush(trace_out);
+}
+
+void* trace_writer(void *arg) {
+    struct timespec interval = {0, TRACE_FLUSH_NS};
+    while (__atomic_load_n(&tracing, __ATOMIC_ACQUIRE)) {
+        trace_drain();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+void trace_stop() {
+    if (!tracing)
+        return;
+    __atomic_store_n(&tracing, false, __ATOMIC_RELEASE);
+    pthread_join(trace_thread, NULL);
+    trace_drain();
+    fprintf(trace_out, "\n]\n");
+    fd_track(fileno(trace_out), NULL);
+    fclose(trace_out);
+    trace_out = NULL;
+    if (trace_ring->dropped != 0) {
+        s_print(STDERR_FILENO, "trace: %d events dropped\n", 1, 
+        (int)trace_ring->dropped);
+    }
+}
+
+bool trace_start(char *path) {
+    if (trace_ring == NULL) {
+        trace_ring = mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (trace_ring == MAP_FAILED) {
+            trace_ring = NULL;
+            return false;
+        }
+    }
+    if ((trace_out = fopen(path, "we")) == NULL)
+        return false;
+    fd_track(fileno(trace_out), "trace");
+    setvbuf(trace_out, NULL, _IOFBF, 1 << 16);
+    memset(trace_ring, 0, sizeof(struct trace_ring));
+    for (int i = 0; i < TRACE_RING_SIZE; ++i)
+        trace_ring->events[i].seq = i;
+    trace_pid = getpid();
+    fprintf(trace_out, "[\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+    "\"args\":{\"name\":\"sfish\"}}", trace_pid);
+
+    tracing = true;
+    sigset_t all_mask, prev_mask;
+    sigfillset(&all_mask);
+    pthread_sigmask(SIG_BLOCK, &all_mask, &prev_mask);
+    pthread_create(&trace_thread, NULL, trace_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &prev_mask, NULL);
+    return true;
+}
+
+int sf_trace(int argc, char **argv) {
+    if (argc == 1) {
+        s_print(STDOUT_FILENO, "trace: %s\n", 1, tracing ? "on" : "off");
+        return 0;
+    }
+    if (argc != 2) {
+        s_print(STDERR_FILENO, "trace: Invalid input\n", 0);
+        return 1;
+    }
+    trace_stop();
+    if (strcmp(argv[1], "off") == 0)
+        return 0;
+    if (!trace_start(argv[1])) {
+        s_print(STDERR_FILENO, "trace: cannot write '%s'\n", 1, argv[1]);
+        return 1;
+    }
+    return 0;
+}
+
 void update_pwd() {
-    getcwd(pwd, PWD_SIZE);
+    free(pwd);
     
     // Handle home shortening
-    char *home = getenv("HOME");
-    int home_len = strlen(home);
-    if (strncmp(pwd, home, home_len) == 0) {
-        char dir_temp[PWD_SIZE];
-        strcpy(dir_temp, pwd + home_len);
+    char *home = var_get("HOME");
+    size_t home_len = home != NULL ? strlen(home) : 0;
+    if (home_len > 1 && strncmp(cwd_path, home, home_len) == 0 &&
+    (cwd_path[home_len] == '/' || cwd_path[home_len] == '\0')) {
+        pwd = malloc(strlen(cwd_path) - home_len + 2);
         pwd[0] = '~';
-        strcpy(pwd + 1, dir_temp);   
+        strcpy(pwd + 1, cwd_path + home_len);   
+    } else {
+        pwd = strdup(cwd_path);
+    }
+    var_set("PWD", cwd_path, true);
+    if (last_path != NULL)
+        var_set("OLDPWD", last_path, true);
+}
+
+// Lexically apply path to the absolute base, as cd's logical mode
+char* path_join(char *base, char *path) {
+    char *joined = malloc(strlen(base) + strlen(path) + 2), *comp;
+    char path_cpy[strlen(path) + 1], *path_ptr = path_cpy;
+    strcpy(joined, path[0] == '/' ? "/" : base);
+    strcpy(path_cpy, path);
+    while ((comp = strsep(&path_ptr, "/")) != NULL) {
+        if (strlen(comp) == 0 || strcmp(comp, ".") == 0)
+            continue;
+        if (strcmp(comp, "..") == 0) {
+            char *slash = strrchr(joined, '/');
+            slash[slash == joined ? 1 : 0] = '\0';
+            continue;
+        }
+        if (joined[strlen(joined) - 1] != '/')
+            strcat(joined, "/");
+        strcat(joined, comp);
+    }
+    return joined;
+}
+
+// Whether the absolute path names the directory open at fd
+bool path_names(char *path, int fd) {
+    struct stat dot, named;
+    return path[0] == '/' && stat(path, &named) != -1 && fstat(fd, &dot) != -1 &&
+    named.st_dev == dot.st_dev && named.st_ino == dot.st_ino;
+}
+
+// Whether path has a .. component
+bool path_has_parent(char *path) {
+    for (char *dots = path; (dots = strstr(dots, "..")) != NULL; dots += 2) {
+        if ((dots == path || dots[-1] == '/') && (dots[2] == '\0' || dots[2] == '/'))
+            return true;
+    }
+    return false;
+}
+
+void init_cwd() {
+    char *env_pwd = var_get("PWD");
+    cwd_fd = fd_track(open(".", O_PATH | O_DIRECTORY | O_CLOEXEC), "cwd");
+
+    // Keep the logical $PWD while it still names the cwd
+    if (env_pwd != NULL && path_names(env_pwd, cwd_fd)) {
+        cwd_path = path_join("/", env_pwd);
+    } else if ((cwd_path = getcwd(NULL, 0)) == NULL) {
+        cwd_path = strdup("/");
     }
+    update_pwd();
 }
 
 int sf_help(int argc, char **argv) {
@@ -125,55 +895,92 @@ int sf_info(int count, int key) {
     return 0;
 }
 
-void sf_exit(int argc, char **argv) {
+// Defined with the job list
+void cgroup_teardown(struct job *job);
+void cgroup_stop();
+
+int sf_exit(int argc, char **argv) {
+    // Ends only the client's session
+    if (server_session != NULL) {
+        server_session->closing = true;
+        return 0;
+    }
+    // Jobs killed here stay listed until the shell exits
+    sigset_t chld_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, NULL);
     struct job *cursor = jobs_head;
     while (cursor != NULL) {
-        kill(-cursor->pid, SIGTERM);
+        cgroup_teardown(cursor);
         cursor = cursor->next;
     }
+    cgroup_stop();
+    trace_stop();
     exit(EXIT_SUCCESS);
 }
 
 int sf_cd(int argc, char **argv) {
-    char *path = argv[1];
-
-    // Save old pwd
-    char prev_pwd[PWD_SIZE];
-    strcpy(prev_pwd, pwd);
+    char *path = argv[1], *home = var_get("HOME"), *target;
+    int fd;
 
-    // Make new changable path
-    char new_path[PWD_SIZE], *new_path_ptr = new_path;
-    memset(new_path, 0, PWD_SIZE);
+    // Swap with the last directory, nothing to resolve
+    if (argc > 1 && strcmp(path, "-") == 0) {
+        if (last_fd == -1)
+            return 0;
+        if (fchdir(last_fd) == -1) {
+            s_print(STDERR_FILENO, "sfish: cd: %s: No such directory\n", 1, 
+            last_path);
+            return 1;
+        }
+        fd = cwd_fd;
+        cwd_fd = last_fd;
+        last_fd = fd;
+        target = cwd_path;
+        cwd_path = last_path;
+        last_path = target;
+        update_pwd();
+        return 0;
+    }
 
     if (argc == 1 || strncmp(path, "~", 1) == 0) {
-        strcpy(new_path_ptr ,getenv("HOME"));
-        if (argc != 1 && strcmp(path, "~") != 0) {
-            size_t homelen = strlen(new_path_ptr);
-            strncpy(new_path_ptr + homelen, path + 1, strlen(path) - 1);
-        }
-    } else if (strcmp(path, "-") == 0) {
-        if (strlen(last_dir) != 0) {
-            if (strncmp(last_dir, "~", 1) == 0) {
-                strcpy(new_path_ptr ,getenv("HOME"));
-                size_t homelen = strlen(new_path_ptr);
-                strncpy(new_path_ptr + homelen, last_dir + 1, 
-                strlen(last_dir) - 1);
-            } else {
-                new_path_ptr = last_dir;
-            }
-        } else {
-            new_path_ptr = pwd;
+        if (home == NULL) {
+            s_print(STDERR_FILENO, "sfish: cd: HOME not set\n", 0);
+            return 1;
         }
+        target = malloc(strlen(home) + (argc == 1 ? 0 : strlen(path)) + 1);
+        strcpy(target, home);
+        if (argc != 1)
+            strcat(target, path + 1);
     } else {
-        strcpy(new_path_ptr, path);
+        target = strdup(path);
     }
 
-    if (chdir(new_path_ptr) == -1) {
-        s_print(STDERR_FILENO, "sfish: cd: %s: No such directory\n", 1, argv[1]);
+    // Open relative to the cwd dirfd
+    char *logical = path_join(cwd_path, target), *physical;
+    if ((fd = fd_track(openat(cwd_fd, target, O_PATH | O_DIRECTORY | O_CLOEXEC), 
+    "cwd")) == -1 ||
+    fchdir(fd) == -1) {
+        s_print(STDERR_FILENO, "sfish: cd: %s: No such directory\n", 1, target);
+        fd_close(fd);
+        free(logical);
+        free(target);
         return 1;
     }
+    // .. steps to the real parent, which the lexical path misses past a symlink
+    if (path_has_parent(target) && !path_names(logical, fd) &&
+    (physical = getcwd(NULL, 0)) != NULL) {
+        free(logical);
+        logical = physical;
+    }
+    fd_close(last_fd);
+    free(last_path);
+    last_fd = cwd_fd;
+    last_path = cwd_path;
+    cwd_fd = fd;
+    cwd_path = logical;
+    free(target);
     update_pwd();
-    strcpy(last_dir, prev_pwd);
 
     return 0;
 }
@@ -263,53 +1070,559 @@ int sf_chclr(int argc, char **argv) {
     return 0;
 }
 
-void free_job(struct job *done_job) {
-    struct exec *cursor = done_job->exec_head, *temp;
-    int i;
-    while (cursor != NULL) {
-        for (i = 0; i < MAX_ARGS; ++i) {
-            if (cursor->argv[i] == NULL)
-                break;
-            free(cursor->argv[i]);
-        }
-        temp = cursor->next;
-        free(cursor);
-        cursor = temp;
+void joblog_write(struct joblog *log, char *data, size_t n) {
+    // Only the newest size bytes survive
+    if (n >= log->size) {
+        data += n - log->size;
+        n = log->size;
     }
-    free(done_job->cmd);
-    free(done_job);
+    size_t first = log->size - log->head < n ? log->size - log->head : n;
+    memcpy(log->buf + log->head, data, first);
+    memcpy(log->buf, data + first, n - first);
+    log->head = (log->head + n) % log->size;
+    log->len = log->len + n > log->size ? log->size : log->len + n;
 }
 
-void add_job(struct job *new_job) {
-    struct job *cursor = jobs_head, *prev_job = NULL;
-    // Find lowest available jid
-    if (cursor == NULL || cursor->jid > 1) {
-        new_job->jid = 1;
-        new_job->next = jobs_head;
-        jobs_head = new_job;
-    } else {
-        while (cursor != NULL) {
-            if (prev_job != NULL && cursor->jid > prev_job->jid + 1) {
-                new_job->jid = prev_job->jid + 1;
-                prev_job->next = new_job;
-                new_job->next = cursor;
-                return;
-            }
-            prev_job = cursor;
-            if (cursor->next == NULL) {
-                cursor->next = new_job;
-                new_job->next = NULL;
+void joblog_drain(struct joblog *log) {
+    char data[JOBLOG_READ];
+    ssize_t n;
+    while (log->fd != -1 && (n = read(log->fd, data, JOBLOG_READ)) != 0) {
+        if (n == -1) {
+            if (errno != EINTR)
                 break;
-            }
-            cursor = cursor->next;
-        }
-        if (new_job->jid == 0) {
-            new_job->jid = cursor->jid + 1;
+            continue;
         }
+        joblog_write(log, data, n);
+    }
+    // All writers gone
+    if (log->fd != -1 && n == 0) {
+        fd_close(log->fd);
+        log->fd = -1;
     }
 }
 
-struct job* find_job(pid_t pid, bool jid) {
+struct joblog* joblog_new(struct job *job) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        return NULL;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    struct joblog *log = calloc(1, sizeof(struct joblog));
+    log->jid = job->jid;
+    log->cmd = strdup(job->cmd);
+    log->fd = fd_track(fds[0], "joblog");
+    log->wfd = fd_track(fds[1], "joblog");
+    log->size = joblog_size;
+    log->buf = malloc(log->size);
+    log->next = joblogs_head;
+    joblogs_head = log;
+    return log;
+}
+
+// Free finished logs beyond the newest JOBLOG_KEEP
+void joblog_prune() {
+    struct joblog *cursor = joblogs_head, *prev = NULL;
+    int kept = 0;
+    while (cursor != NULL) {
+        if (cursor->done && cursor->fd == -1 && ++kept > JOBLOG_KEEP) {
+            if (prev != NULL)
+                prev->next = cursor->next;
+            else
+                joblogs_head = cursor->next;
+            struct joblog *temp = cursor->next;
+            free(cursor->buf);
+            free(cursor->cmd);
+            free(cursor);
+            cursor = temp;
+            continue;
+        }
+        prev = cursor;
+        cursor = cursor->next;
+    }
+}
+
+int sf_joblog(int argc, char **argv) {
+    if (argc == 1) {
+        s_print(STDOUT_FILENO, "joblog: capture %s, %d KiB per job\n", 2, 
+        joblog_on ? "on" : "off", (int)(joblog_size >> 10));
+        return 0;
+    }
+    if (strcmp(argv[1], "on") == 0 && argc <= 3) {
+        if (argc == 3 && atoi(argv[2]) <= 0) {
+            s_print(STDERR_FILENO, "joblog: Invalid input\n", 0);
+            return 1;
+        }
+        if (argc == 3)
+            joblog_size = (size_t)atoi(argv[2]) << 10;
+        joblog_on = true;
+        return 0;
+    }
+    if (strcmp(argv[1], "off") == 0 && argc == 2) {
+        joblog_on = false;
+        return 0;
+    }
+    if (argc != 2 || argv[1][0] != '%') {
+        s_print(STDERR_FILENO, "joblog: Invalid input\n", 0);
+        return 1;
+    }
+
+    // Newest log for the jid, jids are reused
+    int jid = atoi(argv[1] + 1);
+    struct joblog *log = joblogs_head;
+    while (log != NULL && log->jid != jid)
+        log = log->next;
+    if (log == NULL) {
+        s_print(STDERR_FILENO, "joblog: no log for %s\n", 1, argv[1]);
+        return 1;
+    }
+    joblog_drain(log);
+    s_print(STDOUT_FILENO, "[%d]    %s    %s\n", 3, log->jid, 
+    log->done ? "Done" : "Running", log->cmd);
+    size_t start = (log->head + log->size - log->len) % log->size;
+    size_t first = log->size - start < log->len ? log->size - start : log->len;
+    write(STDOUT_FILENO, log->buf + start, first);
+    write(STDOUT_FILENO, log->buf, log->len - first);
+    return 0;
+}
+
+bool cgroup_write(int dirfd, char *file, char *val) {
+    int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool ok = write(fd, val, strlen(val)) == (ssize_t)strlen(val);
+    close(fd);
+    return ok;
+}
+
+// Read a whole cgroup file into buf, false if it is missing
+bool cgroup_read(int dirfd, char *file, char *buf, size_t size) {
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return false;
+    buf[n] = '\0';
+    return true;
+}
+
+// Value of key in a flat-keyed file like cpu.stat, 0 if absent
+uint64_t cgroup_key(char *buf, char *key) {
+    size_t len = strlen(key);
+    for (char *line = buf; line != NULL && *line != '\0'; ) {
+        if (strncmp(line, key, len) == 0 && (line[len] == ' ' || line[len] == '='))
+            return strtoull(line + len + 1, NULL, 10);
+        if ((line = strchr(line, '\n')) != NULL)
+            ++line;
+    }
+    return 0;
+}
+
+// The shell's cgroup v2 directory, from the unified mount and /proc/self/cgroup
+char* cgroup_self() {
+    char *line = NULL, *mnt = NULL, *root = NULL, *rel = NULL, *path = NULL;
+    size_t size = 0;
+    FILE *file;
+    if ((file = fopen("/proc/self/cgroup", "re")) != NULL) {
+        while (rel == NULL && getline(&line, &size, file) != -1) {
+            if (strncmp(line, "0::", 3) == 0)
+                rel = strndup(line + 3, strcspn(line + 3, "\n"));
+        }
+        fclose(file);
+    }
+    if ((file = fopen("/proc/self/mountinfo", "re")) != NULL) {
+        while (mnt == NULL && getline(&line, &size, file) != -1) {
+            // ID PARENT DEV ROOT MOUNT OPTS... - TYPE SOURCE SUPER
+            char *sep = strstr(line, " - cgroup2 "), *fields[5], *cursor = line;
+            for (int i = 0; sep != NULL && i < 5; ++i)
+                fields[i] = strsep(&cursor, " ");
+            if (sep != NULL) {
+                root = strdup(fields[3]);
+                mnt = strdup(fields[4]);
+            }
+        }
+        fclose(file);
+    }
+    free(line);
+    if (rel != NULL && mnt != NULL) {
+        // Containers mount their own group as the root
+        size_t root_len = strcmp(root, "/") == 0 ? 0 : strlen(root);
+        char *sub = strncmp(rel, root, root_len) == 0 ? rel + root_len : rel;
+        path = malloc(strlen(mnt) + strlen(sub) + 1);
+        strcpy(path, mnt);
+        strcat(path, sub);
+    }
+    free(rel);
+    free(mnt);
+    free(root);
+    return path;
+}
+
+// Whether the space-separated list holds ctrl
+bool cgroup_has(char *list, char *ctrl) {
+    size_t len = strlen(ctrl);
+    for (char *at = list; (at = strstr(at, ctrl)) != NULL; at += len) {
+        if ((at == list || at[-1] == ' ') && (at[len] == '\0' || at[len] == ' ' || 
+        at[len] == '\n'))
+            return true;
+    }
+    return false;
+}
+
+bool cgroup_init() {
+    char name[32], *self = cgroup_self(), controllers[256], enabled[256] = "", enable[256];
+    int self_fd = self != NULL ? open(self, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+    free(self);
+    snprintf(name, sizeof(name), "sfish-%d", getpid());
+    if (self_fd == -1 || (mkdirat(self_fd, name, 0755) == -1 && errno != EEXIST) ||
+    fd_track(cgroup_root = openat(self_fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC), 
+    "cgroup") == -1) {
+        if (self_fd != -1)
+            close(self_fd);
+        return false;
+    }
+    cgroup_home = fd_track(self_fd, "cgroup");
+
+    // A group with processes of its own cannot hand controllers to its
+    // children, so the shell moves to a leaf beside its jobs' groups
+    int shell_fd = -1;
+    if (mkdirat(cgroup_root, "shell", 0755) != -1 || errno == EEXIST)
+        shell_fd = openat(cgroup_root, "shell", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (shell_fd != -1) {
+        cgroup_write(shell_fd, "cgroup.procs", "0");
+        close(shell_fd);
+    }
+
+    // Hand jobs whichever controllers were delegated, best effort
+    cgroup_added[0] = '\0';
+    cgroup_read(self_fd, "cgroup.subtree_control", enabled, sizeof(enabled));
+    if (cgroup_read(self_fd, "cgroup.controllers", controllers, sizeof(controllers))) {
+        char *ctrl, *ctrl_ptr = controllers;
+        while ((ctrl = strsep(&ctrl_ptr, " \n")) != NULL) {
+            if (strlen(ctrl) == 0 || !cgroup_has(CGROUP_CONTROLLERS, ctrl))
+                continue;
+            snprintf(enable, sizeof(enable), "+%s", ctrl);
+            if (!cgroup_has(enabled, ctrl) && 
+            cgroup_write(self_fd, "cgroup.subtree_control", enable))
+                var_cat(cgroup_added, 2, ctrl, " ");
+            cgroup_write(cgroup_root, "cgroup.subtree_control", enable);
+        }
+    }
+    cgroup_owner = getpid();
+    return true;
+}
+
+// Make the job's group before it forks; jobs run without one on failure
+void cgroup_job(struct job *job) {
+    char name[32];
+    if (!cgroup_on)
+        return;
+    snprintf(name, sizeof(name), "job%u", ++cgroup_seq);
+    if (mkdirat(cgroup_root, name, 0755) == -1 ||
+    fd_track(job->cgroup_fd = openat(cgroup_root, name, O_PATH | O_DIRECTORY | O_CLOEXEC),
+    "cgroup") == -1)
+        return;
+    job->cgroup = strdup(name);
+}
+
+// Kill everything in the job's group and remove it once empty
+void cgroup_teardown(struct job *job) {
+    char events[256];
+    if (job->cgroup == NULL || !cgroup_write(job->cgroup_fd, "cgroup.kill", "1")) {
+        kill(-job->pid, SIGTERM);
+        return;
+    }
+    int fd = openat(job->cgroup_fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+    uint64_t deadline = now_ns() + CGROUP_KILL_TIMEOUT_MS * 1000000ULL;
+    ssize_t n;
+    while (fd != -1 && (n = pread(fd, events, sizeof(events) - 1, 0)) > 0 &&
+    now_ns() < deadline) {
+        events[n] = '\0';
+        if (strstr(events, "populated 1") == NULL)
+            break;
+        // cgroup.events signals changes with POLLPRI
+        struct pollfd pfd = {fd, POLLPRI, 0};
+        poll(&pfd, 1, CGROUP_KILL_TIMEOUT_MS);
+    }
+    if (fd != -1)
+        close(fd);
+    unlinkat(cgroup_root, job->cgroup, AT_REMOVEDIR);
+    // Already removed, so nothing is left for free_job
+    fd_close(job->cgroup_fd);
+    free(job->cgroup);
+    job->cgroup = NULL;
+}
+
+// Remove the jobs' groups and the shell's own, returning the shell to the
+// group it started in
+void cgroup_stop() {
+    char name[32], disable[256], list[sizeof(CGROUP_CONTROLLERS)], *ctrl, *ctrl_ptr;
+    sigset_t chld_mask, prev_mask;
+    if (cgroup_root == -1 || getpid() != cgroup_owner)
+        return;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &prev_mask);
+    for (struct job *cursor = jobs_head; cursor != NULL; cursor = cursor->next) {
+        if (cursor->cgroup != NULL)
+            cgroup_teardown(cursor);
+    }
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+
+    // Its first group takes processes again once no controllers are handed down
+    strcpy(list, CGROUP_CONTROLLERS);
+    for (ctrl_ptr = list; (ctrl = strsep(&ctrl_ptr, " ")) != NULL;) {
+        snprintf(disable, sizeof(disable), "-%s", ctrl);
+        cgroup_write(cgroup_root, "cgroup.subtree_control", disable);
+    }
+    for (ctrl_ptr = cgroup_added; (ctrl = strsep(&ctrl_ptr, " ")) != NULL;) {
+        snprintf(disable, sizeof(disable), "-%s", ctrl);
+        if (strlen(ctrl) != 0)
+            cgroup_write(cgroup_home, "cgroup.subtree_control", disable);
+    }
+    cgroup_write(cgroup_home, "cgroup.procs", "0");
+    unlinkat(cgroup_root, "shell", AT_REMOVEDIR);
+    snprintf(name, sizeof(name), "sfish-%d", getpid());
+    unlinkat(cgroup_home, name, AT_REMOVEDIR);
+    fd_close(cgroup_root);
+    fd_close(cgroup_home);
+    cgroup_root = cgroup_home = -1;
+    cgroup_on = false;
+}
+
+void cgroup_size(char *buf, size_t size, uint64_t bytes) {
+    char *units = "BKMGT";
+    double val = bytes;
+    int unit = 0;
+    for (; val >= 1024 && unit < 4; ++unit)
+        val /= 1024;
+    snprintf(buf, size, unit == 0 ? "%.0f%c" : "%.1f%c", val, units[unit]);
+}
+
+// Aggregate usage of everything the job started, even after it detached
+void cgroup_report(struct job *job) {
+    char buf[4096], cpu[32] = "-", mem[32] = "-", rd[32] = "-", wr[32] = "-";
+    int procs = 0;
+    if (job->cgroup == NULL) {
+        dprintf(STDOUT_FILENO, "        no cgroup\n");
+        return;
+    }
+    if (cgroup_read(job->cgroup_fd, "cpu.stat", buf, sizeof(buf))) {
+        snprintf(cpu, sizeof(cpu), "%.3fs (user %.3fs sys %.3fs)", 
+        cgroup_key(buf, "usage_usec") / 1e6, cgroup_key(buf, "user_usec") / 1e6,
+        cgroup_key(buf, "system_usec") / 1e6);
+    }
+    if (cgroup_read(job->cgroup_fd, "memory.peak", buf, sizeof(buf)))
+        cgroup_size(mem, sizeof(mem), strtoull(buf, NULL, 10));
+    if (cgroup_read(job->cgroup_fd, "io.stat", buf, sizeof(buf))) {
+        uint64_t rbytes = 0, wbytes = 0;
+        for (char *line = buf; line != NULL && *line != '\0'; ) {
+            char *field = strstr(line, "rbytes="), *end = strchr(line, '\n');
+            if (field != NULL && (end == NULL || field < end))
+                rbytes += strtoull(field + 7, NULL, 10);
+            if ((field = strstr(line, "wbytes=")) != NULL && (end == NULL || field < end))
+                wbytes += strtoull(field + 7, NULL, 10);
+            line = end != NULL ? end + 1 : NULL;
+        }
+        cgroup_size(rd, sizeof(rd), rbytes);
+        cgroup_size(wr, sizeof(wr), wbytes);
+    }
+    if (cgroup_read(job->cgroup_fd, "cgroup.procs", buf, sizeof(buf))) {
+        for (char *c = buf; *c != '\0'; ++c)
+            procs += *c == '\n';
+    }
+    dprintf(STDOUT_FILENO, "        cpu %s  mem peak %s  io read %s write %s  procs %d\n",
+    cpu, mem, rd, wr, procs);
+}
+
+// Publish the job's state in its board slot, taking the oldest finished
+// slot for a new job; signals stay blocked until the slot is consistent
+void board_write(struct job *job, enum sfboard_state state, int status, 
+struct rusage *usage) {
+    struct sfboard_slot *slot;
+    if (job->board_slot == -1) {
+        int free_slot = -1;
+        for (int i = 0; i < SFBOARD_SLOTS && (free_slot == -1 || 
+        board->slots[free_slot].state != SFBOARD_FREE); ++i) {
+            slot = &board->slots[i];
+            if (slot->state == SFBOARD_FREE || (slot->state == SFBOARD_DONE &&
+            (free_slot == -1 || slot->updated < board->slots[free_slot].updated)))
+                free_slot = i;
+        }
+        if (free_slot == -1)
+            return;
+        job->board_slot = free_slot;
+    }
+    slot = &board->slots[job->board_slot];
+    uint32_t seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    uint64_t now = (uint64_t)real.tv_sec * 1000000000ULL + real.tv_nsec;
+    if (slot->jid != job->jid || slot->pgid != job->pid) {
+        slot->jid = job->jid;
+        slot->pgid = job->pid;
+        slot->started = now - (now_ns() - job->started);
+        slot->cpu_usec = slot->mem_peak = 0;
+        strncpy(slot->cmd, job->cmd, SFBOARD_CMD - 1);
+        slot->cmd[SFBOARD_CMD - 1] = '\0';
+    }
+    slot->state = state;
+    slot->exit_status = status;
+    slot->updated = now;
+    char buf[512];
+    if (usage != NULL) {
+        slot->cpu_usec = usage->ru_utime.tv_sec * 1000000ULL + usage->ru_utime.tv_usec +
+        usage->ru_stime.tv_sec * 1000000ULL + usage->ru_stime.tv_usec;
+        slot->mem_peak = usage->ru_maxrss * 1024ULL;
+    } else if (job->cgroup != NULL) {
+        if (cgroup_read(job->cgroup_fd, "cpu.stat", buf, sizeof(buf)))
+            slot->cpu_usec = cgroup_key(buf, "usage_usec");
+        if (cgroup_read(job->cgroup_fd, "memory.peak", buf, sizeof(buf)))
+            slot->mem_peak = strtoull(buf, NULL, 10);
+    }
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&board->gen, 1, __ATOMIC_RELEASE);
+}
+
+// A handler updating the same slot mid-write would break its seqlock, and
+// two writers could claim the same free slot
+void board_update(struct job *job, enum sfboard_state state, int status, 
+struct rusage *usage) {
+    sigset_t all_mask, prev_mask;
+    if (board == NULL)
+        return;
+    sigfillset(&all_mask);
+    sigprocmask(SIG_BLOCK, &all_mask, &prev_mask);
+    board_write(job, state, status, usage);
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+}
+
+void board_cleanup() {
+    // Children inherit the atexit handler
+    if (board != NULL && getpid() == board_owner) {
+        // Readers holding the mapping see it go stale
+        __atomic_store_n(&board->magic, 0, __ATOMIC_RELEASE);
+        unlink(board_path);
+    }
+}
+
+bool board_start() {
+    snprintf(board_path, sizeof(board_path), SFBOARD_PATH, getpid());
+    int fd = open(board_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, sizeof(struct sfboard)) == -1 ||
+    (board = mmap(NULL, sizeof(struct sfboard), PROT_READ | PROT_WRITE, MAP_SHARED,
+    fd, 0)) == MAP_FAILED) {
+        board = NULL;
+        if (fd != -1) {
+            close(fd);
+            unlink(board_path);
+        }
+        return false;
+    }
+    close(fd);
+    board->pid = getpid();
+    board->nslots = SFBOARD_SLOTS;
+    board->version = SFBOARD_VERSION;
+    // Readers check the magic last
+    __atomic_store_n(&board->magic, SFBOARD_MAGIC, __ATOMIC_RELEASE);
+    if (board_owner == 0)
+        atexit(board_cleanup);
+    board_owner = getpid();
+    for (struct job *cursor = jobs_head; cursor != NULL; cursor = cursor->next) {
+        cursor->board_slot = -1;
+        board_update(cursor, cursor->status == exec_status[STOPPED] ? 
+        SFBOARD_STOPPED : SFBOARD_RUNNING, 0, NULL);
+    }
+    return true;
+}
+
+void board_stop() {
+    if (board == NULL)
+        return;
+    __atomic_store_n(&board->magic, 0, __ATOMIC_RELEASE);
+    munmap(board, sizeof(struct sfboard));
+    unlink(board_path);
+    board = NULL;
+}
+
+void free_job(struct job *done_job) {
+    struct exec *cursor = done_job->exec_head, *temp;
+    while (cursor != NULL) {
+        for (int i = 0; i < cursor->argc; ++i)
+            free(cursor->argv[i]);
+        free(cursor->argv);
+        fd_close(cursor->srcfd);
+        fd_close(cursor->desfd);
+        fd_close(cursor->errfd);
+        temp = cursor->next;
+        free(cursor->path);
+        free(cursor);
+        cursor = temp;
+    }
+    // The log outlives the job
+    if (done_job->log != NULL)
+        done_job->log->done = true;
+    // Finished jobs keep their slot until it is needed; disowned ones do not
+    if (board != NULL && done_job->board_slot != -1 &&
+    board->slots[done_job->board_slot].state != SFBOARD_DONE) {
+        struct sfboard_slot *slot = &board->slots[done_job->board_slot];
+        uint32_t seq = slot->seq;
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->state = SFBOARD_FREE;
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&board->gen, 1, __ATOMIC_RELEASE);
+    }
+    if (done_job->coproc != NULL) {
+        fd_close(done_job->co_in);
+        fd_close(done_job->co_out);
+        free(done_job->coproc);
+    }
+    // Removal fails while detached processes still populate the group
+    if (done_job->cgroup != NULL) {
+        if (getpid() == cgroup_owner)
+            unlinkat(cgroup_root, done_job->cgroup, AT_REMOVEDIR);
+        fd_close(done_job->cgroup_fd);
+        free(done_job->cgroup);
+    }
+    free(done_job->cmd);
+    free(done_job);
+}
+
+void add_job(struct job *new_job) {
+    struct job *cursor = jobs_head, *prev_job = NULL;
+    // Find lowest available jid
+    if (cursor == NULL || cursor->jid > 1) {
+        new_job->jid = 1;
+        new_job->next = jobs_head;
+        jobs_head = new_job;
+    } else {
+        while (cursor != NULL) {
+            if (prev_job != NULL && cursor->jid > prev_job->jid + 1) {
+                new_job->jid = prev_job->jid + 1;
+                prev_job->next = new_job;
+                new_job->next = cursor;
+                return;
+            }
+            prev_job = cursor;
+            if (cursor->next == NULL) {
+                cursor->next = new_job;
+                new_job->next = NULL;
+                break;
+            }
+            cursor = cursor->next;
+        }
+        if (new_job->jid == 0) {
+            new_job->jid = cursor->jid + 1;
+        }
+    }
+}
+
+struct job* find_job(pid_t pid, bool jid) {
     if (pid < 1)
         return NULL;
     struct job *cursor = jobs_head;
@@ -324,9 +1637,25 @@ struct job* find_job(pid_t pid, bool jid) {
     return cursor;
 }
 
+struct job* find_coproc(char *name) {
+    struct job *cursor = jobs_head;
+    while (cursor != NULL && (cursor->coproc == NULL || strcmp(cursor->coproc, name) != 0))
+        cursor = cursor->next;
+    return cursor;
+}
+
+// Close the shell's ends of every coprocess, so a job parent holds none open
+void coproc_close_all() {
+    for (struct job *cursor = jobs_head; cursor != NULL; cursor = cursor->next) {
+        if (cursor->coproc != NULL) {
+            fd_close(cursor->co_in);
+            fd_close(cursor->co_out);
+        }
+    }
+}
+
 void remove_job(struct job *dead_job) {
     struct job *cursor = jobs_head, *prev = NULL;
-    printf("pid: %d\n", getpid());
     if (dead_job == NULL)
         return;
     while (cursor != dead_job) {
@@ -343,14 +1672,23 @@ void remove_job(struct job *dead_job) {
 
 int print_jobs(int argc, char **argv) {
     struct job *cursor = jobs_head;
+    bool usage = argc > 1 && strcmp(argv[1], "-l") == 0;
     while (cursor != NULL) {
         if (strcmp(cursor->exec_head->argv[0], "jobs") != 0) {
             s_print(STDOUT_FILENO, "[%d]    %s    %d    %s\n", 4, 
             cursor->jid, cursor->status, cursor->pid, cursor->cmd);
+            if (usage)
+                cgroup_report(cursor);
         }
         cursor = cursor->next;
     }
-    return 1;
+    for (struct timer *timer = timers_head; timer != NULL; timer = timer->next) {
+        dprintf(STDOUT_FILENO, "[t%d]    %s    %s %s    %s    (%u runs, %u skipped)\n",
+        timer->id, timer->pid != 0 && find_job(timer->pid, false) != NULL ? 
+        exec_status[RUNNING] : "Waiting", timer->repeat ? "every" : "at", 
+        timer->interval, timer->cmd, timer->runs, timer->skipped);
+    }
+    return 0;
 }
 
 int sf_kill(int argc, char **argv) {
@@ -402,7 +1740,24 @@ int sf_kill(int argc, char **argv) {
     return 0;
 }
 
+// Record a reaped job's status for wait and drop it from the list
+void job_finish(struct job *job, int status, struct rusage *usage) {
+    board_update(job, SFBOARD_DONE, status, usage);
+    lat_record(L_JOB, now_ns() - job->started);
+    trace_span("job", job->cmd, job->started);
+    struct job_done *done = &jobs_done[jobs_done_next++ % JOBS_DONE_SIZE];
+    done->jid = job->jid;
+    done->pid = job->pid;
+    done->status = status;
+    remove_job(job);
+}
+
 int sf_fg(int argc, char **argv) {
+    // Blocking on a job would stall every other session
+    if (server_session != NULL) {
+        s_print(STDERR_FILENO, "fg: not available in server mode\n", 0);
+        return 1;
+    }
     if (argc != 2)
         return 1;
     // JID
@@ -422,9 +1777,17 @@ int sf_fg(int argc, char **argv) {
         return 1;
     }
     int status, prev_errno = errno;
+    struct rusage usage;
     new_fg->fg = true;
-    if (waitpid(new_fg->pid, &status, WUNTRACED) < 0) {
+    board_update(new_fg, SFBOARD_RUNNING, 0, NULL);
+    if (wait4(new_fg->pid, &status, WUNTRACED, &usage) < 0) {
         errno = prev_errno;
+    } else if (WIFSTOPPED(status)) {
+        new_fg->fg = false;
+        new_fg->status = exec_status[STOPPED];
+        board_update(new_fg, SFBOARD_STOPPED, 0, NULL);
+    } else {
+        job_finish(new_fg, status, &usage);
     }
     return 0;
 }
@@ -449,6 +1812,8 @@ int sf_bg(int argc, char **argv) {
     }
     kill(-res_job->pid, SIGCONT);
     res_job->status = exec_status[RUNNING];
+    board_update(res_job, SFBOARD_RUNNING, 0, NULL);
+    trace_instant("continue", res_job->cmd);
     return 0;
 }
 
@@ -481,271 +1846,1945 @@ int sf_disown(int argc, char **argv) {
     return 0;
 }
 
-void* get_builtin(char *cmd, bool *mproc) {
-    bool *mp;
-    if (mproc != NULL)
-        mp = mproc;
-    else {
-        bool mpro;
-        mp = &mpro;
+// Status of a job that already finished, -1 if it is not remembered
+int job_done_status(pid_t id, bool jid) {
+    for (int i = 1; i <= JOBS_DONE_SIZE && i <= jobs_done_next; ++i) {
+        struct job_done *done = &jobs_done[(jobs_done_next - i) % JOBS_DONE_SIZE];
+        if ((jid ? done->jid : done->pid) == id)
+            return done->status;
     }
-    if (strcmp(cmd, "help") == 0) {
-        *mp = false; 
-        return &sf_help;
-    }
-    if (strcmp(cmd, "exit") == 0) {
-        *mp = true;
-        return &sf_exit;
+    return -1;
+}
+
+// Signal that stopped the job, or 0 while it runs; SIGCHLD must be blocked
+int job_stop_sig(struct job *job) {
+    siginfo_t info;
+    info.si_pid = 0;
+    // Leave the stop for fg to collect
+    if (waitid(P_PID, job->pid, &info, WSTOPPED | WNOHANG | WNOWAIT) == 0 && 
+    info.si_pid != 0) {
+        job->status = exec_status[STOPPED];
+        board_update(job, SFBOARD_STOPPED, 0, NULL);
+        return info.si_status;
     }
-    if (strcmp(cmd, "cd") == 0) {
-        *mp = true;
-        return &sf_cd;
+    // Stopped before, with its stop already collected
+    return job->status == exec_status[STOPPED] ? SIGTSTP : 0;
+}
+
+int sf_wait(int argc, char **argv) {
+    bool any = false;
+    double timeout = -1;
+    char *end;
+    int opt = 1;
+    // Blocking on jobs would stall every other session
+    if (server_session != NULL) {
+        s_print(STDERR_FILENO, "wait: not available in server mode\n", 0);
+        return 2;
     }
-    if (strcmp(cmd, "pwd") == 0) {
-        *mp = false; 
-        return &sf_pwd;
+    for (; opt < argc && argv[opt][0] == '-'; ++opt) {
+        if (strcmp(argv[opt], "-n") == 0) {
+            any = true;
+        } else if (strcmp(argv[opt], "-t") == 0 && opt + 1 < argc &&
+        (timeout = strtod(argv[opt + 1], &end)) >= 0 && *end == '\0') {
+            ++opt;
+        } else {
+            s_print(STDERR_FILENO, "wait: Invalid input\n", 0);
+            return 2;
+        }
     }
-    if (strcmp(cmd, "prt") == 0) {
-        *mp= false; 
-        return &sf_prt;
+    bool ids = opt < argc;
+
+    // Keep sigchld_handler from reaping the jobs waited on
+    sigset_t chld_mask, prev_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &prev_mask);
+
+    int njob = 0, ntarget = 0, ret = 0, status;
+    for (struct job *cursor = jobs_head; cursor != NULL; cursor = cursor->next)
+        ++njob;
+    struct job *targets[ids ? argc - opt : njob];
+    for (struct job *cursor = jobs_head; !ids && cursor != NULL; cursor = cursor->next)
+        targets[ntarget++] = cursor;
+    for (; opt < argc; ++opt) {
+        bool jid = argv[opt][0] == '%';
+        pid_t id = atoi(argv[opt] + jid);
+        struct job *job = find_job(id, jid);
+        bool dup = false;
+        for (int i = 0; i < ntarget && !dup; ++i)
+            dup = targets[i] == job;
+        if (job != NULL && !dup) {
+            targets[ntarget++] = job;
+        }
+        // Already reaped, or never ours
+        else if (job == NULL && (status = job_done_status(id, jid)) != -1) {
+            ret = exit_code(status);
+            if (any) {
+                sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+                return ret;
+            }
+        } else if (job == NULL) {
+            s_print(STDERR_FILENO, "wait: %s: no such job\n", 1, argv[opt]);
+            ret = 127;
+        }
     }
-    if (strcmp(cmd, "chpmt") == 0) {
-        *mp = true;
-        return &sf_chpmt;
+
+    // One poll over a pidfd per job, a timerfd for the deadline and a
+    // signalfd that wakes on stops, which pidfds do not report
+    struct pollfd fds[ntarget + 2];
+    int remaining = 0, sig;
+    for (int i = 0; i < ntarget; ++i) {
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+        if ((fds[i].fd = syscall(SYS_pidfd_open, targets[i]->pid, 0)) != -1)
+            ++remaining;
+        else
+            s_print(STDERR_FILENO, "wait: cannot watch %d\n", 1, targets[i]->pid);
     }
-    if (strcmp(cmd, "chclr") == 0) {
-        *mp = true;
-        return &sf_chclr;
+    fds[ntarget].events = POLLIN;
+    fds[ntarget].fd = -1;
+    if (timeout >= 0 && remaining > 0 &&
+    (fds[ntarget].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) != -1) {
+        struct itimerspec deadline = {{0, 0}, {(time_t)timeout, 
+        (long)((timeout - (time_t)timeout) * 1e9)}};
+        // A zero it_value disarms the timer
+        if (deadline.it_value.tv_sec == 0 && deadline.it_value.tv_nsec == 0)
+            deadline.it_value.tv_nsec = 1;
+        timerfd_settime(fds[ntarget].fd, 0, &deadline, NULL);
     }
-    if (strcmp(cmd, "jobs") == 0) {
-        *mp = false;
-        return &print_jobs;
+    fds[ntarget + 1].events = POLLIN;
+    fds[ntarget + 1].fd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    bool chld_read = false;
+
+    // Without ids the status is 0, otherwise that of the last job to finish;
+    // a stopped job ends the wait with 128 plus its stop signal
+    bool reaped = false;
+    for (;;) {
+        for (int i = 0; i < ntarget && !(any && reaped); ++i) {
+            if (fds[i].fd == -1)
+                continue;
+            if (fds[i].revents != 0 && waitpid(targets[i]->pid, &status, WNOHANG) > 0) {
+                if (ids || any)
+                    ret = exit_code(status);
+                job_finish(targets[i], status, NULL);
+            } else if ((sig = job_stop_sig(targets[i])) != 0) {
+                if (ids || any)
+                    ret = 128 + sig;
+            } else {
+                continue;
+            }
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            --remaining;
+            reaped = true;
+        }
+        if (remaining == 0 || (any && reaped))
+            break;
+        if (poll(fds, ntarget + 2, -1) == -1) {
+            // A failure other than an interrupt would repeat forever
+            ret = errno == EINTR ? 130 : 1;
+            if (ret == 1)
+                s_print(STDERR_FILENO, "wait: cannot poll\n", 0);
+            break;
+        }
+        if (fds[ntarget].fd != -1 && fds[ntarget].revents != 0) {
+            s_print(STDERR_FILENO, "wait: timed out\n", 0);
+            ret = 124;
+            break;
+        }
+        struct signalfd_siginfo info;
+        while (fds[ntarget + 1].fd != -1 && 
+        read(fds[ntarget + 1].fd, &info, sizeof(info)) == sizeof(info))
+            chld_read = true;
     }
-    if (strcmp(cmd, "fg") == 0) {
-        *mp = true;
-        return &sf_fg;
+    for (int i = 0; i <= ntarget + 1; ++i) {
+        if (fds[i].fd != -1)
+            close(fds[i].fd);
     }
-    if (strcmp(cmd, "bg") == 0) {
-        *mp = true;
-        return &sf_bg;
-    }    
-    if (strcmp(cmd, "kill") == 0) {
-        *mp = true;
-        return &sf_kill;
+    // Leave other children's exits to sigchld_handler once unblocked
+    if (chld_read)
+        raise(SIGCHLD);
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    return ret;
+}
+
+int sf_cgroup(int argc, char **argv) {
+    if (argc == 1) {
+        s_print(STDOUT_FILENO, "cgroup %s\n", 1, cgroup_on ? "on" : "off");
+        return 0;
     }
-    if (strcmp(cmd, "disown") == 0) {
-        *mp = true;
-        return &sf_disown;
+    if (strcmp(argv[1], "off") == 0) {
+        cgroup_on = false;
+    } else if (strcmp(argv[1], "on") == 0) {
+        if (cgroup_root == -1 && !cgroup_init()) {
+            s_print(STDERR_FILENO, "cgroup: no writable cgroup v2 hierarchy, "
+            "jobs run without accounting\n", 0);
+            return 1;
+        }
+        cgroup_on = true;
+    } else {
+        s_print(STDERR_FILENO, "cgroup: Invalid input\n", 0);
+        return 1;
     }
-    return NULL;
+    return 0;
 }
 
-void make_prompt(char* prompt) {
-    // Fix sfish prompt
-    memset(prompt, 0, PROMPT_SIZE);
-    strcat(prompt, "sfish");
-
-    if (user == NULL) {
-        user = getenv("USER");
+// SIZE with an optional K, M, G or T suffix, or max
+bool cgroup_bytes(char *str, char *buf, size_t size) {
+    char *unit;
+    if (strcmp(str, "max") == 0) {
+        snprintf(buf, size, "max");
+        return true;
     }
-    if (strlen(machine) == 0) {
-        gethostname(machine, HOSTNAME_SIZE);
+    unsigned long long val = strtoull(str, &unit, 10);
+    char *units = "KMGT", *pos;
+    if (unit == str || (*unit != '\0' && ((pos = strchr(units, *unit)) == NULL || 
+    unit[1] != '\0')))
+        return false;
+    if (*unit != '\0')
+        val <<= 10 * (pos - units + 1);
+    snprintf(buf, size, "%llu", val);
+    return true;
+}
+
+int sf_limit(int argc, char **argv) {
+    if (argc < 3) {
+        s_print(STDERR_FILENO, "limit: Invalid input\n", 0);
+        return 1;
     }
-    if (strlen(pwd) == 0) {
-        update_pwd();
+    bool jid = argv[1][0] == '%';
+    struct job *job = find_job(atoi(argv[1] + jid), jid);
+    if (job == NULL || job->cgroup == NULL) {
+        s_print(STDERR_FILENO, "limit: %s: no such cgroup job\n", 1, argv[1]);
+        return 1;
     }
-
-    // Add user and/or machine
-    if (user_tag) { 
-        var_cat(prompt, 4, "-", user_color, user, CLOSE_TAG);
-        if (mach_tag) {
-            var_cat(prompt, 5, "@", machine_color, machine, CLOSE_TAG, ":");
+    int ret = 0;
+    char val[64], *file;
+    for (int i = 2; i < argc; ++i) {
+        bool valid = true;
+        if (strncmp(argv[i], "cpu=", 4) == 0) {
+            // Percent of one CPU over the default 100ms period
+            file = "cpu.max";
+            if (strcmp(argv[i] + 4, "max") == 0)
+                snprintf(val, sizeof(val), "max 100000");
+            else if ((valid = atoi(argv[i] + 4) > 0))
+                snprintf(val, sizeof(val), "%d 100000", atoi(argv[i] + 4) * 1000);
+        } else if (strncmp(argv[i], "mem=", 4) == 0) {
+            file = "memory.max";
+            valid = cgroup_bytes(argv[i] + 4, val, sizeof(val));
+        } else if (strncmp(argv[i], "pids=", 5) == 0) {
+            file = "pids.max";
+            snprintf(val, sizeof(val), "%s", argv[i] + 5);
+            valid = strcmp(val, "max") == 0 || atoi(val) > 0;
         } else {
-            strcat(prompt, ":");
+            valid = false;
+        }
+        if (!valid) {
+            s_print(STDERR_FILENO, "limit: %s: Invalid input\n", 1, argv[i]);
+            ret = 1;
+        } else if (!cgroup_write(job->cgroup_fd, file, val)) {
+            s_print(STDERR_FILENO, "limit: cannot set %s, controller not delegated\n", 
+            1, file);
+            ret = 1;
         }
-    } else if (mach_tag) {
-        var_cat(prompt, 5, "-", machine_color, machine, CLOSE_TAG, ":");
-    } else {
-        strcat(prompt, ":");
     }
+    return ret;
+}
 
-    // Add pwd
-    var_cat(prompt, 3, "[", pwd, "]>");
+bool hist_remap(struct hist_file *hf, size_t size) {
+    char *map;
+    if (hf->map == NULL)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, hf->fd, 0);
+    else
+        map = mremap(hf->map, hf->size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+        return false;
+    hf->map = map;
+    hf->size = size;
+    return true;
 }
 
-bool check_exec(char *exec) {
-    if (get_builtin(exec, NULL) != NULL) {
-        return true;
-    }
-    bool valid = false;
-    char *path_buf = calloc(PWD_SIZE, sizeof(char));
+bool hist_open(struct hist_file *hf, char *path, size_t init_size) {
     struct stat stats;
-    // Direct location
-    if (strstr(exec, "/") != NULL) {
-        var_cat(path_buf, 3, pwd, "/", exec);
-        if (stat(path_buf, &stats) == -1) {
-            valid = true;
-        }
+    hf->map = NULL;
+    if (fd_track(hf->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR),
+    "history") == -1)
+        return false;
+    if (fstat(hf->fd, &stats) == -1 || (stats.st_size < init_size &&
+    ftruncate(hf->fd, init_size) == -1)) {
+        fd_close(hf->fd);
+        hf->fd = -1;
+        return false;
     }
-
-    // Unspecified location
-    else {
-        char path_list[PWD_SIZE], *path_ptr = path_list, *cur_dir;
-        strcpy(path_list, getenv("PATH"));
+    if (!hist_remap(hf, stats.st_size < init_size ? init_size : stats.st_size)) {
+        fd_close(hf->fd);
+        hf->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// Pick up growth made by other shells sharing the files
+void hist_sync(struct hist_file *hf) {
+    struct stat stats;
+    if (fstat(hf->fd, &stats) != -1 && stats.st_size > hf->size)
+        hist_remap(hf, stats.st_size);
+}
+
+// Make room for need more bytes past used, doubling the file
+bool hist_reserve(struct hist_file *hf, uint64_t used, size_t need) {
+    size_t size = hf->size;
+    if (used + need <= size)
+        return true;
+    while (used + need > size)
+        size <<= 1;
+    if (ftruncate(hf->fd, size) == -1)
+        return false;
+    return hist_remap(hf, size);
+}
+
+struct hist_entry* hist_at(uint64_t off) {
+    return (struct hist_entry*)(hist_log.map + off);
+}
+
+char* hist_text(struct hist_entry *entry) {
+    if (entry->cmd_len == 0)
+        entry = hist_at(entry->ref);
+    return (char*)(entry + 1) + entry->cwd_len + 1;
+}
+
+uint32_t hist_trigram(char *str) {
+    uint32_t tri = (unsigned char)str[0] << 16 | (unsigned char)str[1] << 8 | 
+    (unsigned char)str[2];
+    return (tri * 2654435761U) >> 16;
+}
+
+struct hist_bucket* hist_bucket_at(uint32_t tri) {
+    return (struct hist_bucket*)(hist_idx.map + sizeof(struct hist_idx_header)) +
+    tri;
+}
+
+void hist_post(uint32_t tri, uint64_t off) {
+    struct hist_idx_header *header = (struct hist_idx_header*)hist_idx.map;
+    struct hist_bucket *bucket = hist_bucket_at(tri);
+    struct hist_block *block = NULL;
+    if (bucket->head != 0)
+        block = (struct hist_block*)(hist_idx.map + bucket->head);
+
+    // Chain a new block when the head one is full
+    if (block == NULL || block->n == HIST_BLOCK_IDS) {
+        uint64_t prev = bucket->head, used = header->used;
+        if (!hist_reserve(&hist_idx, used, sizeof(struct hist_block)))
+            return;
+        header = (struct hist_idx_header*)hist_idx.map;
+        bucket = hist_bucket_at(tri);
+        block = (struct hist_block*)(hist_idx.map + used);
+        block->prev = prev;
+        block->n = 0;
+        bucket->head = used;
+        header->used = used + sizeof(struct hist_block);
+    }
+    block->offs[block->n++] = off;
+    ++bucket->count;
+}
+
+int hist_tri_cmp(const void *a, const void *b) {
+    uint32_t x = *(uint32_t*)a, y = *(uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+void hist_index_text(uint64_t off) {
+    char *text = hist_text(hist_at(off));
+    size_t len = strlen(text);
+    if (len < 3)
+        return;
+    uint32_t *tris = malloc((len - 2) * sizeof(uint32_t));
+    if (tris == NULL)
+        return;
+    for (size_t i = 0; i + 2 < len; ++i)
+        tris[i] = hist_trigram(text + i);
+    // Post each distinct trigram of the entry once
+    qsort(tris, len - 2, sizeof(uint32_t), hist_tri_cmp);
+    for (size_t i = 0; i < len - 2; ++i) {
+        if (i == 0 || tris[i] != tris[i - 1])
+            hist_post(tris[i], off);
+    }
+    free(tris);
+}
+
+void hist_dedup_note(uint64_t off) {
+    char *text = hist_text(hist_at(off));
+    uint64_t hash = str_hash(text);
+    struct hist_dedup *slot = &hist_dedup[hash % HIST_DEDUP_SLOTS];
+    slot->hash = hash;
+    slot->off = hist_at(off)->cmd_len == 0 ? hist_at(off)->ref : off;
+}
+
+uint64_t hist_dedup_find(char *cmd) {
+    uint64_t hash = str_hash(cmd);
+    struct hist_dedup *slot = &hist_dedup[hash % HIST_DEDUP_SLOTS];
+    if (slot->off != 0 && slot->hash == hash &&
+    strcmp(hist_text(hist_at(slot->off)), cmd) == 0)
+        return slot->off;
+    return 0;
+}
+
+// Whether a whole entry, with its text and length copy, lies at off below used
+bool hist_entry_ok(uint64_t off, uint64_t used) {
+    if (off < sizeof(struct hist_header) || used > hist_log.size || 
+    off + sizeof(struct hist_entry) + 2 + sizeof(uint32_t) > used)
+        return false;
+    struct hist_entry *entry = hist_at(off);
+    char *data = (char*)(entry + 1);
+    if (entry->len < sizeof(struct hist_entry) + entry->cwd_len + entry->cmd_len + 2 +
+    sizeof(uint32_t) || entry->len > used - off || data[entry->cwd_len] != '\0' ||
+    *(uint32_t*)(hist_log.map + off + entry->len - sizeof(uint32_t)) != entry->len)
+        return false;
+    // Repeats point back at an entry holding its own text
+    if (entry->cmd_len == 0)
+        return entry->ref < off && hist_entry_ok(entry->ref, off) && 
+        hist_at(entry->ref)->cmd_len != 0;
+    return data[entry->cwd_len + 1 + entry->cmd_len] == '\0';
+}
+
+void hist_idx_reset() {
+    struct hist_idx_header *idx_header = (struct hist_idx_header*)hist_idx.map;
+    size_t idx_init = sizeof(struct hist_idx_header) + 
+    HIST_BUCKETS * sizeof(struct hist_bucket);
+    memset(hist_idx.map, 0, idx_init);
+    idx_header->magic = HIST_IDX_MAGIC;
+    idx_header->nbuckets = HIST_BUCKETS;
+    idx_header->used = idx_init;
+    idx_header->indexed = sizeof(struct hist_header);
+    memset(hist_dedup, 0, sizeof(hist_dedup));
+}
+
+// Truncate a corrupt log after its last whole entry
+void hist_repair() {
+    struct hist_header *header = (struct hist_header*)hist_log.map;
+    uint64_t off = sizeof(struct hist_header), used = header->used;
+    if (used > hist_log.size)
+        used = hist_log.size;
+    uint32_t n = 0;
+    for (; hist_entry_ok(off, used); off += hist_at(off)->len)
+        ++n;
+    header->used = off;
+    header->nentries = n;
+    if (((struct hist_idx_header*)hist_idx.map)->indexed > off)
+        hist_idx_reset();
+}
+
+// Index log entries appended since the index was last written
+void hist_catchup() {
+    struct hist_header *log_header = (struct hist_header*)hist_log.map;
+    struct hist_idx_header *idx_header = (struct hist_idx_header*)hist_idx.map;
+    uint64_t off = idx_header->indexed;
+    while (off < log_header->used) {
+        if (!hist_entry_ok(off, log_header->used)) {
+            hist_repair();
+            off = ((struct hist_idx_header*)hist_idx.map)->indexed;
+            continue;
+        }
+        // Repeats share the text, and its postings, of the entry they point at
+        struct hist_entry *entry = hist_at(off);
+        if (entry->cmd_len != 0)
+            hist_index_text(off);
+        hist_dedup_note(off);
+        off += entry->len;
+        idx_header = (struct hist_idx_header*)hist_idx.map;
+        idx_header->indexed = off;
+    }
+}
+
+void hist_add(char *cmd, char *cwd, int status, int64_t start, uint32_t duration) {
+    if (hist_log.map == NULL || strlen(cmd) == 0)
+        return;
+    flock(hist_log.fd, LOCK_EX);
+    hist_sync(&hist_log);
+    hist_sync(&hist_idx);
+    hist_catchup();
+
+    // Repeated commands reference the entry holding their text
+    uint64_t ref = hist_dedup_find(cmd);
+    size_t cwd_len = strlen(cwd), cmd_len = ref != 0 ? 0 : strlen(cmd);
+    size_t len = sizeof(struct hist_entry) + cwd_len + 1 + cmd_len + 1 + 
+    sizeof(uint32_t);
+    len = (len + 7) & ~7;
+
+    struct hist_header *header = (struct hist_header*)hist_log.map;
+    uint64_t off = header->used;
+    if (cwd_len > UINT16_MAX || cmd_len > UINT16_MAX ||
+    !hist_reserve(&hist_log, off, len)) {
+        flock(hist_log.fd, LOCK_UN);
+        return;
+    }
+    header = (struct hist_header*)hist_log.map;
+    struct hist_entry *entry = hist_at(off);
+    entry->len = len;
+    entry->status = status;
+    entry->start = start;
+    entry->ref = ref != 0 ? ref : off;
+    entry->duration = duration;
+    entry->cwd_len = cwd_len;
+    entry->cmd_len = cmd_len;
+    char *data = (char*)(entry + 1);
+    memcpy(data, cwd, cwd_len + 1);
+    if (cmd_len != 0)
+        memcpy(data + cwd_len + 1, cmd, cmd_len + 1);
+    *(uint32_t*)(hist_log.map + off + len - sizeof(uint32_t)) = len;
+    ++header->nentries;
+    header->used = off + len;
+
+    hist_catchup();
+    flock(hist_log.fd, LOCK_UN);
+}
+
+bool hist_seen_has(uint64_t *seen, int nseen, uint64_t off) {
+    for (int i = 0; i < nseen; ++i) {
+        if (seen[i] == off)
+            return true;
+    }
+    return false;
+}
+
+// Newest entry containing query whose text is not in seen
+uint64_t hist_search(char *query, uint64_t *seen, int nseen) {
+    struct hist_header *header = (struct hist_header*)hist_log.map;
+    size_t qlen = strlen(query);
+
+    // Short queries have no trigram: walk the log backwards
+    if (qlen < 3) {
+        uint64_t off = header->used;
+        while (off > sizeof(struct hist_header)) {
+            off -= *(uint32_t*)(hist_log.map + off - sizeof(uint32_t));
+            struct hist_entry *entry = hist_at(off);
+            if (strstr(hist_text(entry), query) != NULL && 
+            !hist_seen_has(seen, nseen, entry->ref))
+                return entry->ref;
+        }
+        return 0;
+    }
+
+    // Scan the query trigram with the shortest posting list
+    struct hist_bucket *best = NULL;
+    for (size_t i = 0; i + 2 < qlen; ++i) {
+        struct hist_bucket *bucket = hist_bucket_at(hist_trigram(query + i));
+        if (best == NULL || bucket->count < best->count)
+            best = bucket;
+    }
+    uint64_t block_off = best->head;
+    while (block_off != 0) {
+        struct hist_block *block = (struct hist_block*)(hist_idx.map + block_off);
+        for (int i = block->n - 1; i >= 0; --i) {
+            uint64_t off = block->offs[i];
+            if (strstr(hist_text(hist_at(off)), query) != NULL &&
+            !hist_seen_has(seen, nseen, off))
+                return off;
+        }
+        block_off = block->prev;
+    }
+    return 0;
+}
+
+void hist_init() {
+    char *file = var_get("SFISH_HISTFILE"), *home = var_get("HOME");
+    if (file == NULL && home == NULL)
+        return;
+    char log_path[PATH_MAX], idx_path[PATH_MAX];
+    if (file != NULL)
+        snprintf(log_path, PATH_MAX, "%s", file);
+    else
+        snprintf(log_path, PATH_MAX, "%s/.sfish_history", home);
+    if (snprintf(idx_path, PATH_MAX, "%s.idx", log_path) >= PATH_MAX)
+        return;
+
+    size_t idx_init = sizeof(struct hist_idx_header) + 
+    HIST_BUCKETS * sizeof(struct hist_bucket);
+    if (!hist_open(&hist_log, log_path, HIST_LOG_INIT))
+        return;
+    if (!hist_open(&hist_idx, idx_path, idx_init)) {
+        munmap(hist_log.map, hist_log.size);
+        fd_close(hist_log.fd);
+        hist_log.map = NULL;
+        return;
+    }
+
+    flock(hist_log.fd, LOCK_EX);
+    struct hist_header *header = (struct hist_header*)hist_log.map;
+    if (header->magic != HIST_MAGIC) {
+        header->magic = HIST_MAGIC;
+        header->nentries = 0;
+        header->used = sizeof(struct hist_header);
+    }
+    // Rebuild an index that is missing or from another log
+    struct hist_idx_header *idx_header = (struct hist_idx_header*)hist_idx.map;
+    if (idx_header->magic != HIST_IDX_MAGIC || idx_header->indexed > header->used)
+        hist_idx_reset();
+    // The header and entries come from disk: cut the log at the first bad one
+    hist_repair();
+    hist_catchup();
+
+    // Seed readline with the most recent entries, oldest first
+    header = (struct hist_header*)hist_log.map;
+    uint64_t off = header->used;
+    int n = 0;
+    while (off > sizeof(struct hist_header) && n < HIST_MEM_MAX) {
+        uint32_t len = *(uint32_t*)(hist_log.map + off - sizeof(uint32_t));
+        if (len == 0 || len > off || !hist_entry_ok(off - len, header->used)) {
+            hist_repair();
+            off = header->used;
+            n = 0;
+            continue;
+        }
+        off -= len;
+        ++n;
+    }
+    stifle_history(HIST_MEM_MAX);
+    while (off < header->used) {
+        add_history(hist_text(hist_at(off)));
+        off += hist_at(off)->len;
+    }
+    flock(hist_log.fd, LOCK_UN);
+}
+
+void hist_record(char *cmd, char *cwd, struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint32_t duration = (end.tv_sec - start->tv_sec) * 1000 + 
+    (end.tv_nsec - start->tv_nsec) / 1000000;
+
+    // Keep readline's list bounded and free of consecutive repeats
+    HIST_ENTRY *last = history_get(history_base + history_length - 1);
+    if (strlen(cmd) != 0 && (last == NULL || strcmp(last->line, cmd) != 0))
+        add_history(cmd);
+    hist_add(cmd, cwd, last_return, time(NULL) - duration / 1000, duration);
+}
+
+int hist_search_handler(int count, int key) {
+    static char *query;
+    static uint64_t seen[HIST_SEEN_MAX];
+    static int nseen;
+    if (hist_log.map == NULL)
+        return 0;
+
+    // Start over unless the line still shows the last match
+    if (nseen == 0 || nseen == HIST_SEEN_MAX || 
+    strcmp(rl_line_buffer, hist_text(hist_at(seen[nseen - 1]))) != 0) {
+        free(query);
+        query = strdup(rl_line_buffer);
+        nseen = 0;
+    }
+
+    flock(hist_log.fd, LOCK_SH);
+    hist_sync(&hist_log);
+    hist_sync(&hist_idx);
+    uint64_t off = hist_search(query, seen, nseen);
+    if (off == 0) {
+        rl_ding();
+    } else {
+        seen[nseen++] = off;
+        rl_replace_line(hist_text(hist_at(off)), 0);
+        rl_point = rl_end;
+    }
+    flock(hist_log.fd, LOCK_UN);
+    return 0;
+}
+
+int sf_history(int argc, char **argv) {
+    if (hist_log.map == NULL) {
+        s_print(STDERR_FILENO, "history: no history file\n", 0);
+        return 1;
+    }
+    int n = 10;
+    char *query = NULL;
+    if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+        query = argv[2];
+    } else if (argc == 2 && (n = atoi(argv[1])) > 0) {
+    } else if (argc != 1) {
+        s_print(STDERR_FILENO, "history: Invalid input\n", 0);
+        return 1;
+    }
+
+    flock(hist_log.fd, LOCK_SH);
+    hist_sync(&hist_log);
+    hist_sync(&hist_idx);
+    struct hist_header *header = (struct hist_header*)hist_log.map;
+    if (query != NULL) {
+        // Distinct matches, newest first
+        uint64_t seen[HIST_SEEN_MAX], off;
+        int nseen = 0;
+        while (nseen < HIST_SEEN_MAX && (off = hist_search(query, seen, nseen)) != 0) {
+            seen[nseen++] = off;
+            dprintf(STDOUT_FILENO, "%s\n", hist_text(hist_at(off)));
+        }
+    } else {
+        uint64_t off = header->used;
+        int i = 0, num = header->nentries;
+        while (off > sizeof(struct hist_header) && i < n) {
+            off -= *(uint32_t*)(hist_log.map + off - sizeof(uint32_t));
+            ++i;
+        }
+        for (num -= i; off < header->used; off += hist_at(off)->len) {
+            struct hist_entry *entry = hist_at(off);
+            dprintf(STDOUT_FILENO, "%6d  %4d  %6ums  %s  %s\n", ++num,
+            entry->status, entry->duration, (char*)(entry + 1), hist_text(entry));
+        }
+    }
+    flock(hist_log.fd, LOCK_UN);
+    return 0;
+}
+
+// Defined with the parser it batches for
+int sf_xargs(int argc, char **argv);
+// Defined with eval_cmd, which runs function bodies and timer jobs
+int sf_call(int argc, char **argv);
+int sf_every(int argc, char **argv);
+int sf_at(int argc, char **argv);
+int sf_coproc(int argc, char **argv);
+int sf_board(int argc, char **argv);
+
+struct builtin builtins[] = {
+    {"help", &sf_help, false},
+    {"exit", &sf_exit, true},
+    {"cd", &sf_cd, true},
+    {"pwd", &sf_pwd, false},
+    {"prt", &sf_prt, false},
+    {"chpmt", &sf_chpmt, true},
+    {"chclr", &sf_chclr, true},
+    {"jobs", &print_jobs, false},
+    {"fg", &sf_fg, true},
+    {"bg", &sf_bg, true},
+    {"kill", &sf_kill, true},
+    {"disown", &sf_disown, true},
+    {"history", &sf_history, false},
+    {"stats", &sf_stats, false},
+    {"xargs", &sf_xargs, false},
+    {"joblog", &sf_joblog, true},
+    {"trace", &sf_trace, true},
+    {"export", &sf_export, true},
+    {"unset", &sf_unset, true},
+    {"unalias", &sf_unalias, true},
+    {"wait", &sf_wait, true},
+    {"fds", &sf_fds, true},
+    {"cgroup", &sf_cgroup, true},
+    {"limit", &sf_limit, true},
+    {"every", &sf_every, true},
+    {"at", &sf_at, true},
+    {"coproc", &sf_coproc, true},
+    {"board", &sf_board, true},
+    {NULL, NULL, false}
+};
+
+// Builtins first, then functions, which run in the shell process
+void* get_builtin(char *cmd, bool *mproc) {
+    bool mp = false;
+    void *func = NULL;
+    for (struct builtin *cursor = builtins; cursor->name != NULL; ++cursor) {
+        if (strcmp(cmd, cursor->name) == 0) {
+            mp = cursor->mproc;
+            func = cursor->func;
+            break;
+        }
+    }
+    if (func == NULL && var_is_assign(cmd)) {
+        mp = true;
+        func = &sf_assign;
+    } else if (func == NULL && shfunc_find(funcs, cmd) != NULL) {
+        mp = true;
+        func = &sf_call;
+    }
+    if (mproc != NULL)
+        *mproc = mp;
+    return func;
+}
+
+char* make_prompt(char* prompt) {
+    char *user = var_get("USER");
+    if (user == NULL)
+        user = "";
+    if (strlen(machine) == 0) {
+        gethostname(machine, HOSTNAME_SIZE);
+    }
+
+    // Grow for long working directories
+    size_t size = strlen(pwd) + strlen(user) + HOSTNAME_SIZE + 64;
+    if (size < PROMPT_SIZE)
+        size = PROMPT_SIZE;
+    prompt = realloc(prompt, size);
+
+    // Fix sfish prompt
+    memset(prompt, 0, size);
+    strcat(prompt, "sfish");
+
+    // Add user and/or machine
+    if (user_tag) { 
+        var_cat(prompt, 4, "-", user_color, user, CLOSE_TAG);
+        if (mach_tag) {
+            var_cat(prompt, 5, "@", machine_color, machine, CLOSE_TAG, ":");
+        } else {
+            strcat(prompt, ":");
+        }
+    } else if (mach_tag) {
+        var_cat(prompt, 5, "-", machine_color, machine, CLOSE_TAG, ":");
+    } else {
+        strcat(prompt, ":");
+    }
+
+    // Add pwd
+    var_cat(prompt, 3, "[", pwd, "]>");
+    return prompt;
+}
+
+unsigned path_hash(char *name) {
+    unsigned hash = 5381;
+    for (; *name != '\0'; ++name)
+        hash = hash * 33 + (unsigned char)*name;
+    return hash % PATH_CACHE_SIZE;
+}
+
+// Flush when PATH no longer matches the one the cache was filled from
+bool path_cache_check() {
+    char *path_env = var_get("PATH");
+    if (path_env == NULL)
+        path_env = "";
+    if (path_cache_env == NULL || strcmp(path_cache_env, path_env) != 0) {
+        for (int i = 0; i < PATH_CACHE_SIZE; ++i) {
+            struct path_ent *cursor = path_cache[i], *temp;
+            while (cursor != NULL) {
+                temp = cursor->next;
+                free(cursor->name);
+                free(cursor->path);
+                free(cursor);
+                cursor = temp;
+            }
+            path_cache[i] = NULL;
+        }
+        free(path_cache_env);
+        path_cache_env = strdup(path_env);
+        ++path_cache_gen;
+        return false;
+    }
+    return true;
+}
+
+char* path_cache_get(char *name) {
+    if (!path_cache_check())
+        return NULL;
+    struct path_ent *cursor = path_cache[path_hash(name)];
+    while (cursor != NULL && strcmp(cursor->name, name) != 0)
+        cursor = cursor->next;
+    return cursor != NULL ? cursor->path : NULL;
+}
+
+void path_cache_put(char *name, char *path) {
+    struct path_ent *ent = calloc(1, sizeof(struct path_ent));
+    unsigned hash = path_hash(name);
+    ent->name = strdup(name);
+    ent->path = strdup(path);
+    ent->next = path_cache[hash];
+    path_cache[hash] = ent;
+}
+
+bool check_exec(char *exec, char **path) {
+    *path = NULL;
+    if (get_builtin(exec, NULL) != NULL) {
+        return true;
+    }
+    uint64_t lookup_start = now_ns();
+    bool valid = false;
+    char *path_buf = calloc(PATH_MAX, sizeof(char));
+    struct stat stats;
+    // Direct location
+    if (strstr(exec, "/") != NULL) {
+        if (faccessat(cwd_fd, exec, X_OK, 0) == 0) {
+            valid = true;
+        }
+    }
+
+    // Unspecified location
+    else if ((*path = path_cache_get(exec)) != NULL) {
+        metric_inc(M_PATH_HITS);
+        *path = strdup(*path);
+        valid = true;
+    } else {
+        metric_inc(M_PATH_MISSES);
+        char *path_env = path_cache_env;
+        char path_list[strlen(path_env) + 1], *path_ptr = path_list, *cur_dir;
+        strcpy(path_list, path_env);
         while ((cur_dir = strsep(&path_ptr, ":")) != NULL) {
+            if (strlen(cur_dir) + strlen(exec) + 2 > PATH_MAX)
+                continue;
             var_cat(path_buf, 3, cur_dir, "/", exec);  
             if (stat(path_buf, &stats) != -1) {
+                path_cache_put(exec, path_buf);
+                *path = strdup(path_buf);
                 valid = true;
+                break;
+            }
+            memset(path_buf, 0, PATH_MAX);
+        }
+    }
+    free(path_buf);
+    trace_span("check_exec", exec, lookup_start);
+    if (!valid) {
+        s_print(STDERR_FILENO, "No command '%s' found\n", 1, exec);
+    }
+    return valid;
+} 
+
+// Launch one batch of xargs items, returning its pid
+pid_t xargs_launch(char **argv, char *path) {
+    pid_t pid;
+    uint64_t forked = now_ns();
+    metric_inc(M_FORKS);
+    if ((pid = fork()) == 0) {
+        metric_inc(M_EXECS);
+        lat_record(L_LAUNCH, now_ns() - forked);
+        trace_instant("exec", argv[0]);
+        // The items come from stdin, so commands must not read them
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd != -1)
+            dup2(null_fd, STDIN_FILENO);
+        close_range(3, ~0U, 0);
+        execve(path != NULL ? path : argv[0], argv, var_environ());
+        s_print(STDERR_FILENO, "%s: command not found\n", 1, argv[0]);
+        exit(127);
+    }
+    return pid;
+}
+
+bool xargs_reap(pid_t pid) {
+    int status;
+    while ((pid = waitpid(pid, &status, 0)) == -1 && errno == EINTR);
+    return pid != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int sf_xargs(int argc, char **argv) {
+    int max_items = 0, max_procs = 1, running = 0, opt = 1;
+    char delim = '\0';
+    bool nul = false, failed = false;
+    for (; opt < argc && argv[opt][0] == '-'; ++opt) {
+        if (strcmp(argv[opt], "-0") == 0) {
+            nul = true;
+        } else if (strcmp(argv[opt], "-n") == 0 && opt + 1 < argc &&
+        (max_items = atoi(argv[opt + 1])) > 0) {
+            ++opt;
+        } else if (strcmp(argv[opt], "-P") == 0 && opt + 1 < argc &&
+        (max_procs = atoi(argv[opt + 1])) > 0) {
+            ++opt;
+        } else {
+            s_print(STDERR_FILENO, "xargs: Invalid input\n", 0);
+            return 1;
+        }
+    }
+    char *cmd[] = {"echo", NULL};
+    char **base = opt < argc ? argv + opt : cmd;
+    int nbase = opt < argc ? argc - opt : 1;
+    char *path = NULL;
+    if (strchr(base[0], '/') == NULL && !check_exec(base[0], &path))
+        return 1;
+
+    // Room left under ARG_MAX once the environment and fixed args are in
+    long room = sysconf(_SC_ARG_MAX) - 2048;
+    for (char **env = var_environ(); *env != NULL; ++env)
+        room -= strlen(*env) + 1 + sizeof(char*);
+    for (int i = 0; i < nbase; ++i)
+        room -= strlen(base[i]) + 1 + sizeof(char*);
+
+    int cap = nbase + 64, nargs = nbase;
+    char **args = malloc(cap * sizeof(char*));
+    memcpy(args, base, nbase * sizeof(char*));
+    long used = 0;
+    size_t len = 0, size = 256;
+    char *item = malloc(size), buf[JOBLOG_READ];
+    ssize_t n;
+    bool eof = false;
+
+    while (!eof) {
+        if ((n = read(STDIN_FILENO, buf, JOBLOG_READ)) <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            eof = true;
+            n = 0;
+        }
+        for (ssize_t i = 0; i <= n; ++i) {
+            // Items end at the delimiter, or at end of input
+            bool end = i == n ? eof : (nul ? buf[i] == delim : 
+            strchr(" \t\n", buf[i]) != NULL);
+            if (!end) {
+                if (i == n)
+                    break;
+                if (len + 1 >= size)
+                    item = realloc(item, size <<= 1);
+                item[len++] = buf[i];
+                continue;
+            }
+            if (len == 0)
+                continue;
+            item[len] = '\0';
+
+            // Launch the batch when this item would not fit
+            long cost = len + 1 + sizeof(char*);
+            if (nargs > nbase && (used + cost > room || 
+            (max_items != 0 && nargs - nbase == max_items))) {
+                args[nargs] = NULL;
+                if (running == max_procs) {
+                    failed |= !xargs_reap(-1);
+                    --running;
+                }
+                xargs_launch(args, path);
+                ++running;
+                for (int j = nbase; j < nargs; ++j)
+                    free(args[j]);
+                nargs = nbase;
+                used = 0;
+            }
+            if (nargs + 1 >= cap)
+                args = realloc(args, (cap <<= 1) * sizeof(char*));
+            args[nargs++] = strdup(item);
+            used += cost;
+            len = 0;
+        }
+    }
+    if (nargs > nbase) {
+        args[nargs] = NULL;
+        if (running == max_procs) {
+            failed |= !xargs_reap(-1);
+            --running;
+        }
+        xargs_launch(args, path);
+        ++running;
+        for (int j = nbase; j < nargs; ++j)
+            free(args[j]);
+    }
+    for (; running > 0; --running)
+        failed |= !xargs_reap(-1);
+    free(args);
+    free(item);
+    free(path);
+    return failed ? 123 : 0;
+}
+
+bool glob_has_meta(char *word) {
+    return strpbrk(word, "*?[") != NULL;
+}
+
+// Compile one path component into tokens, returning their count
+int glob_compile(char *pat, struct glob_tok *toks) {
+    int ntok = 0;
+    for (; *pat != '\0'; ++pat, ++ntok) {
+        struct glob_tok *tok = &toks[ntok];
+        memset(tok, 0, sizeof(struct glob_tok));
+        // A class closes within this component, else [ matches itself
+        char *close = NULL;
+        if (pat[0] == '[' && pat[1] != '\0')
+            close = memchr(pat + 2, ']', strcspn(pat + 2, "/"));
+        if (*pat == '*') {
+            tok->type = G_STAR;
+            // Runs of stars match the same as one
+            while (pat[1] == '*')
+                ++pat;
+        } else if (*pat == '?') {
+            tok->type = G_ANY;
+        } else if (close != NULL) {
+            bool negate = pat[1] == '!' || pat[1] == '^';
+            tok->type = G_CLASS;
+            for (char *c = pat + 1 + negate; c < close; ++c) {
+                unsigned lo = (unsigned char)*c, hi = lo;
+                if (c[1] == '-' && c + 2 < close) {
+                    hi = (unsigned char)c[2];
+                    c += 2;
+                }
+                for (; lo <= hi; ++lo)
+                    tok->set[lo >> 3] |= 1 << (lo & 7);
+            }
+            if (negate)
+                for (int i = 0; i < 32; ++i)
+                    tok->set[i] = ~tok->set[i];
+            pat = close;
+        } else {
+            tok->type = G_CHAR;
+            if (*pat == '\\' && pat[1] != '\0')
+                ++pat;
+            tok->c = *pat;
+        }
+    }
+    return ntok;
+}
+
+// Match with backtracking to the most recent star only
+bool glob_match(struct glob_tok *toks, int ntok, char *str) {
+    int tok = 0, star = -1;
+    char *resume = NULL;
+    while (*str != '\0') {
+        unsigned char c = *str;
+        if (tok < ntok && toks[tok].type == G_STAR) {
+            star = tok++;
+            resume = str;
+        } else if (tok < ntok && (toks[tok].type == G_ANY ||
+        (toks[tok].type == G_CHAR && toks[tok].c == *str) ||
+        (toks[tok].type == G_CLASS && (toks[tok].set[c >> 3] & (1 << (c & 7)))))) {
+            ++tok;
+            ++str;
+        } else if (star != -1) {
+            tok = star + 1;
+            str = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (tok < ntok && toks[tok].type == G_STAR)
+        ++tok;
+    return tok == ntok;
+}
+
+int glob_ent_cmp(const void *a, const void *b) {
+    return strcmp(((struct glob_ent*)a)->name, ((struct glob_ent*)b)->name);
+}
+
+void glob_dir_free(struct glob_dir *dir) {
+    free(dir->path);
+    free(dir->ents);
+    free(dir->names);
+    free(dir);
+}
+
+// Sorted listing of dir, read in bulk with getdents64 unless cached
+struct glob_dir* glob_dir_get(char *path) {
+    static char *dents;
+    struct stat stats;
+    char *open_path = strlen(path) > 0 ? path : ".";
+    if (fstatat(cwd_fd, open_path, &stats, 0) == -1 || !S_ISDIR(stats.st_mode))
+        return NULL;
+
+    // Cached listings are keyed by absolute path
+    char *key = path[0] == '/' ? strdup(path) : path_join(cwd_path, path);
+    struct glob_dir **cursor = &glob_cache, *dir;
+    while (*cursor != NULL && strcmp((*cursor)->path, key) != 0)
+        cursor = &(*cursor)->next;
+    if ((dir = *cursor) != NULL) {
+        *cursor = dir->next;
+        if (dir->dev == stats.st_dev && dir->ino == stats.st_ino &&
+        dir->mtime.tv_sec == stats.st_mtim.tv_sec && 
+        dir->mtime.tv_nsec == stats.st_mtim.tv_nsec &&
+        now_ns() - dir->loaded < GLOB_CACHE_TTL_NS) {
+            metric_inc(M_GLOB_HITS);
+            dir->next = glob_cache;
+            glob_cache = dir;
+            free(key);
+            return dir;
+        }
+        glob_dir_free(dir);
+    }
+    metric_inc(M_GLOB_MISSES);
+
+    int fd = openat(cwd_fd, open_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        free(key);
+        return NULL;
+    }
+    if (dents == NULL)
+        dents = malloc(GLOB_DENTS_SIZE);
+    dir = calloc(1, sizeof(struct glob_dir));
+    dir->path = key;
+    dir->dev = stats.st_dev;
+    dir->ino = stats.st_ino;
+    dir->mtime = stats.st_mtim;
+    dir->loaded = now_ns();
+
+    // Names are packed into one buffer, pointers fixed up once it stops moving
+    size_t used = 0, size = 4096, *offs = NULL;
+    int cap = 0;
+    long n;
+    dir->names = malloc(size);
+    while ((n = syscall(SYS_getdents64, fd, dents, GLOB_DENTS_SIZE)) > 0) {
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *dent = (struct linux_dirent64*)(dents + pos);
+            pos += dent->d_reclen;
+            if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+                continue;
+            size_t len = strlen(dent->d_name) + 1;
+            if (used + len > size)
+                dir->names = realloc(dir->names, size = (used + len) << 1);
+            if (dir->nents == cap) {
+                cap = cap == 0 ? 256 : cap << 1;
+                dir->ents = realloc(dir->ents, cap * sizeof(struct glob_ent));
+                offs = realloc(offs, cap * sizeof(size_t));
+            }
+            memcpy(dir->names + used, dent->d_name, len);
+            offs[dir->nents] = used;
+            dir->ents[dir->nents++].type = dent->d_type;
+            used += len;
+        }
+    }
+    close(fd);
+    for (int i = 0; i < dir->nents; ++i)
+        dir->ents[i].name = dir->names + offs[i];
+    free(offs);
+    qsort(dir->ents, dir->nents, sizeof(struct glob_ent), glob_ent_cmp);
+
+    // Newest first, dropping the oldest when full
+    dir->next = glob_cache;
+    glob_cache = dir;
+    int count = 0;
+    for (cursor = &glob_cache; *cursor != NULL && count < GLOB_CACHE_SIZE; ++count)
+        cursor = &(*cursor)->next;
+    if (*cursor != NULL) {
+        glob_dir_free(*cursor);
+        *cursor = NULL;
+    }
+    return dir;
+}
+
+void glob_push(char ***argv, int *argc, int *cap, char *word) {
+    // Keep room for the NULL terminator
+    if (*argc + 1 >= *cap)
+        *argv = realloc(*argv, (*cap <<= 1) * sizeof(char*));
+    (*argv)[(*argc)++] = word;
+    (*argv)[*argc] = NULL;
+}
+
+// Expand the components of comps under base into argv
+void glob_walk(char *base, char **comps, int ncomp, char ***argv, int *argc, int *cap) {
+    size_t base_len = strlen(base);
+    if (!glob_has_meta(comps[0])) {
+        char path[base_len + strlen(comps[0]) + 2];
+        var_cat(strcpy(path, base), 2, comps[0], ncomp > 1 ? "/" : "");
+        if (ncomp > 1)
+            glob_walk(path, comps + 1, ncomp - 1, argv, argc, cap);
+        else if (faccessat(cwd_fd, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+            glob_push(argv, argc, cap, strdup(path));
+        return;
+    }
+
+    struct glob_tok toks[strlen(comps[0])];
+    int ntok = glob_compile(comps[0], toks);
+    struct glob_dir *dir = glob_dir_get(base);
+    if (dir == NULL)
+        return;
+    struct stat stats;
+    for (int i = 0; i < dir->nents; ++i) {
+        struct glob_ent *ent = &dir->ents[i];
+        // Hidden names only match a pattern starting with a dot
+        if ((ent->name[0] == '.' && comps[0][0] != '.') || 
+        !glob_match(toks, ntok, ent->name))
+            continue;
+        char path[base_len + strlen(ent->name) + 2];
+        var_cat(strcpy(path, base), 2, ent->name, ncomp > 1 ? "/" : "");
+        if (ncomp == 1) {
+            glob_push(argv, argc, cap, strdup(path));
+        } else if (ent->type == DT_DIR || ((ent->type == DT_LNK || 
+        ent->type == DT_UNKNOWN) && fstatat(cwd_fd, path, &stats, 0) != -1 &&
+        S_ISDIR(stats.st_mode))) {
+            glob_walk(path, comps + 1, ncomp - 1, argv, argc, cap);
+        }
+    }
+}
+
+// Push the sorted matches of word, or word itself if none match
+void glob_expand(char *word, char ***argv, int *argc, int *cap) {
+    char pat[strlen(word) + 1], *pat_ptr = pat, *comp;
+    char *comps[strlen(word) + 1];
+    int ncomp = 0, start = *argc;
+    strcpy(pat, word);
+    if (pat[0] == '/')
+        ++pat_ptr;
+    while ((comp = strsep(&pat_ptr, "/")) != NULL)
+        comps[ncomp++] = comp;
+    glob_walk(word[0] == '/' ? "/" : "", comps, ncomp, argv, argc, cap);
+    if (*argc == start)
+        glob_push(argv, argc, cap, strdup(word));
+    free(word);
+}
+
+// strsep on sep, except within parentheses
+char* split_next(char **str, char sep) {
+    char *start = *str, *pos = start;
+    int depth = 0;
+    if (start == NULL)
+        return NULL;
+    for (; *pos != '\0' && (*pos != sep || depth > 0); ++pos) {
+        if (*pos == '(')
+            ++depth;
+        else if (*pos == ')' && depth > 0)
+            --depth;
+    }
+    *str = *pos != '\0' ? pos + 1 : NULL;
+    *pos = '\0';
+    return start;
+}
+
+// Length of the parenthesized group opening str, through its closing parenthesis
+size_t paren_len(char *str) {
+    int depth = 0;
+    size_t len = 0;
+    do {
+        depth += str[len] == '(' ? 1 : str[len] == ')' ? -1 : 0;
+        ++len;
+    } while (str[len] != '\0' && depth > 0);
+    return depth > 0 ? 0 : len;
+}
+
+// <(CMD) or >(CMD), run with its output or input on a /dev/fd/N pipe
+bool procsub_word(char *word) {
+    size_t len = strlen(word);
+    return (word[0] == '<' || word[0] == '>') && word[1] == '(' && word[len - 1] == ')';
+}
+
+// Split one pipeline stage into words and redirections
+bool make_args(char *cmd, struct stage *stage, bool *bg) {
+    struct redir **redir_tail = &stage->redirs;
+    int redir = -1, cap = ARGV_INIT;
+    char *start, *base = cmd;
+    size_t len = strlen(cmd);
+    stage->argc = 0;
+    stage->argv = calloc(cap, sizeof(char*));
+    // Words only end at bytes the scanner marks, so they are skipped whole
+    static uint64_t *ops;
+    static size_t ops_cap;
+    if (SCAN_WORDS(len) > ops_cap)
+        ops = realloc(ops, (ops_cap = SCAN_WORDS(len)) * sizeof(uint64_t));
+    scan_block(cmd, len, NULL, ops);
+
+    while (*cmd != '\0') {
+        if (*cmd == ' ' || *cmd == '\t') {
+            ++cmd;
+            continue;
+        }
+        // Process substitution, up to the matching parenthesis
+        if ((*cmd == '<' || *cmd == '>') && cmd[1] == '(') {
+            size_t len = paren_len(cmd + 1);
+            if (len == 0 || redir != -1) {
+                s_print(STDERR_FILENO, "Invalid command\n", 0);
+                return false;
             }
-            memset(path_buf, 0, PWD_SIZE);
+            start = cmd;
+            cmd += len + 1;
+            if (stage->argc + 1 == cap)
+                stage->argv = realloc(stage->argv, (cap <<= 1) * sizeof(char*));
+            stage->argv[stage->argc++] = strndup(start, cmd - start);
+            stage->argv[stage->argc] = NULL;
+            continue;
+        }
+
+        // Operators
+        if (redir == -1 && strncmp(cmd, "<<<", 3) == 0) {
+            redir = REDIR_HERESTR;
+            cmd += 3;
+            continue;
+        } else if (redir == -1 && strncmp(cmd, "<<", 2) == 0) {
+            redir = REDIR_HEREDOC;
+            cmd += 2;
+            continue;
+        } else if (redir == -1 && (*cmd == '<' || *cmd == '>') && cmd[1] == '&') {
+            // Coprocess ends, named by the word that follows
+            redir = *cmd == '<' ? REDIR_COIN : REDIR_COOUT;
+            cmd += 2;
+            continue;
+        } else if (redir == -1 && *cmd == '<') {
+            redir = REDIR_IN;
+            ++cmd;
+            continue;
+        } else if (redir == -1 && *cmd == '>') {
+            redir = cmd[1] == '>' ? REDIR_APPEND : REDIR_OUT;
+            cmd += redir == REDIR_APPEND ? 2 : 1;
+            continue;
+        } else if (redir == -1 && strncmp(cmd, "2>", 2) == 0) {
+            redir = REDIR_ERR;
+            cmd += 2;
+            continue;
+        } else if (*cmd == '&' && cmd[strspn(cmd + 1, " \t") + 1] == '\0') {
+            *bg = true;
+            break;
         }
+
+        // Word
+        start = cmd;
+        while (*cmd != '\0') {
+            cmd = base + scan_next(ops, len, cmd - base);
+            if (*cmd == '\0' || strchr(" \t<>", *cmd) != NULL || 
+            (*cmd == '&' && cmd[strspn(cmd + 1, " \t") + 1] == '\0'))
+                break;
+            // $(CMD) stays in one word whatever it holds
+            if (*cmd == '$' && cmd[1] == '(') {
+                size_t len = paren_len(cmd + 1);
+                if (len == 0) {
+                    s_print(STDERR_FILENO, "Invalid command\n", 0);
+                    return false;
+                }
+                cmd += len + 1;
+            } else {
+                ++cmd;
+            }
+        }
+        if (cmd == start) {
+            s_print(STDERR_FILENO, "Invalid command\n", 0);
+            return false;
+        }
+        if (redir != -1) {
+            *redir_tail = calloc(1, sizeof(struct redir));
+            (*redir_tail)->type = redir;
+            (*redir_tail)->file = strndup(start, cmd - start);
+            redir_tail = &(*redir_tail)->next;
+            redir = -1;
+        } else {
+            // Keep room for the NULL terminator
+            if (stage->argc + 1 == cap) {
+                stage->argv = realloc(stage->argv, (cap <<= 1) * sizeof(char*));
+            }
+            stage->argv[stage->argc++] = strndup(start, cmd - start);
+            stage->argv[stage->argc] = NULL;
+        }
+    }
+    if (redir != -1 || stage->argc == 0) {
+        s_print(STDERR_FILENO, "Invalid command\n", 0);
+        return false;
+    }
+    return true;
+}
+
+void parse_free(struct parsed *parsed) {
+    struct stage *stage = parsed->stages, *next_stage;
+    while (stage != NULL) {
+        for (int i = 0; i < stage->argc; ++i)
+            free(stage->argv[i]);
+        free(stage->argv);
+        struct redir *redir = stage->redirs, *next_redir;
+        while (redir != NULL) {
+            next_redir = redir->next;
+            free(redir->file);
+            free(redir);
+            redir = next_redir;
+        }
+        next_stage = stage->next;
+        free(stage->path);
+        free(stage);
+        stage = next_stage;
+    }
+    free(parsed->line);
+    free(parsed->cwd);
+    free(parsed);
+}
+
+// Replace a here-document's delimiter with its body, taken from the lines
+// in bodies up to the delimiter line
+void heredoc_body(struct redir *redir, char **bodies) {
+    char *line = *bodies, *nl;
+    size_t len;
+    while (line != NULL && *line != '\0') {
+        nl = strchr(line, '\n');
+        len = nl != NULL ? (size_t)(nl - line) : strlen(line);
+        if (len == strlen(redir->file) && strncmp(line, redir->file, len) == 0) {
+            free(redir->file);
+            redir->file = strndup(*bodies, line - *bodies);
+            *bodies = line + len + (nl != NULL);
+            return;
+        }
+        line = nl != NULL ? nl + 1 : NULL;
+    }
+    // Unterminated, the body runs to the end of input
+    free(redir->file);
+    redir->file = strdup(*bodies != NULL ? *bodies : "");
+    if (*bodies != NULL)
+        *bodies += strlen(*bodies);
+}
+
+struct parsed* parse_cmd(char *input) {
+    struct parsed *parsed = calloc(1, sizeof(struct parsed));
+    struct stage **stage_tail = &parsed->stages;
+    parsed->line = strdup(input);
+    parsed->fg = true;
+    
+    // Copy input to sep
+    char cmd[strlen(input) + 1], *cmdp = cmd, *bodies;
+    strcpy(cmd, input);
+    // Here-document bodies follow the command line
+    if ((bodies = strchr(cmd, '\n')) != NULL)
+        *bodies++ = '\0';
+
+    // pstat prefixes a job rather than running as a stage
+    while (*cmdp == ' ')
+        ++cmdp;
+    if (strncmp(cmdp, "pstat ", 6) == 0) {
+        parsed->pstat = true;
+        cmdp += 6;
+    }
+
+    // Separate by pipe
+    char *exec_str;
+    bool bg = false;
+    while ((exec_str = split_next(&cmdp, '|')) != NULL) {
+        *stage_tail = calloc(1, sizeof(struct stage));
+        ++parsed->nstage;
+        // Commands named by a variable resolve once expanded
+        if (!make_args(exec_str, *stage_tail, &bg) || 
+        (strchr((*stage_tail)->argv[0], '$') == NULL &&
+        !check_exec((*stage_tail)->argv[0], &(*stage_tail)->path))) {
+            parse_free(parsed);
+            return NULL;
+        }
+        for (struct redir *redir = (*stage_tail)->redirs; redir != NULL; redir = redir->next) {
+            if (redir->type == REDIR_HEREDOC)
+                heredoc_body(redir, &bodies);
+        }
+        stage_tail = &(*stage_tail)->next;
+    }
+    parsed->fg = !bg;
+
+    // Record what the cached form depends on
+    struct stat stats;
+    parsed->cwd = strdup(cwd_path);
+    parsed->path_gen = path_cache_gen;
+    for (struct stage *stage = parsed->stages; stage != NULL; stage = stage->next) {
+        if (stage->path != NULL && stat(stage->path, &stats) != -1) {
+            stage->mtime = stats.st_mtim;
+            stage->ino = stats.st_ino;
+        }
+    }
+    return parsed;
+}
+
+bool parse_valid(struct parsed *parsed) {
+    struct stat stats;
+    if (strcmp(parsed->cwd, cwd_path) != 0 || !path_cache_check() ||
+    parsed->path_gen != path_cache_gen)
+        return false;
+    for (struct stage *stage = parsed->stages; stage != NULL; stage = stage->next) {
+        if (stage->path != NULL && (stat(stage->path, &stats) == -1 ||
+        stats.st_ino != stage->ino || stats.st_mtim.tv_sec != stage->mtime.tv_sec ||
+        stats.st_mtim.tv_nsec != stage->mtime.tv_nsec))
+            return false;
+    }
+    return true;
+}
+
+void parse_cache_unlink(struct parsed *parsed) {
+    struct parsed **bucket = &parse_cache[parsed->hash % PARSE_CACHE_BUCKETS];
+    while (*bucket != parsed)
+        bucket = &(*bucket)->chain;
+    *bucket = parsed->chain;
+    if (parsed->prev != NULL)
+        parsed->prev->next = parsed->next;
+    else
+        parse_lru_head = parsed->next;
+    if (parsed->next != NULL)
+        parsed->next->prev = parsed->prev;
+    else
+        parse_lru_tail = parsed->prev;
+    --parse_cache_count;
+}
+
+void parse_cache_push(struct parsed *parsed) {
+    struct parsed **bucket = &parse_cache[parsed->hash % PARSE_CACHE_BUCKETS];
+    parsed->chain = *bucket;
+    *bucket = parsed;
+    parsed->prev = NULL;
+    parsed->next = parse_lru_head;
+    if (parse_lru_head != NULL)
+        parse_lru_head->prev = parsed;
+    else
+        parse_lru_tail = parsed;
+    parse_lru_head = parsed;
+    ++parse_cache_count;
+}
+
+struct parsed* parse_cache_get(char *input) {
+    uint64_t hash = str_hash(input);
+    struct parsed *cursor = parse_cache[hash % PARSE_CACHE_BUCKETS];
+    while (cursor != NULL && (cursor->hash != hash || strcmp(cursor->line, input) != 0))
+        cursor = cursor->chain;
+
+    if (cursor == NULL || !parse_valid(cursor)) {
+        if (cursor != NULL) {
+            parse_cache_unlink(cursor);
+            parse_free(cursor);
+        }
+        metric_inc(M_PARSE_MISSES);
+        if ((cursor = parse_cmd(input)) == NULL)
+            return NULL;
+        cursor->hash = hash;
+        // Evict least recently used
+        if (parse_cache_count == PARSE_CACHE_SIZE) {
+            struct parsed *victim = parse_lru_tail;
+            parse_cache_unlink(victim);
+            parse_free(victim);
+        }
+    } else {
+        metric_inc(M_PARSE_HITS);
+        parse_cache_unlink(cursor);
+    }
+    parse_cache_push(cursor);
+    return cursor;
+}
+
+// Sealed memfd holding text, read back from the start
+int heredoc_open(char *text, bool newline) {
+    int fd = memfd_create("sfish-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    size_t len = strlen(text), done = 0;
+    ssize_t n;
+    if (fd == -1)
+        return -1;
+    while (done < len && (n = write(fd, text + done, len - done)) > 0)
+        done += n;
+    if (done < len || (newline && write(fd, "\n", 1) != 1) ||
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+    lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Defined with the command list runner
+void eval_list(char *input);
+// Defined with the job launcher
+void init_job_handlers();
+
+// Run an output-only builtin in the shell with stdout on a memfd, NULL if cmd
+// is not one
+char* cmdsub_builtin(char *cmd) {
+    if (strpbrk(cmd, "|<>&;()") != NULL)
+        return NULL;
+    char copy[strlen(cmd) + 1], *pos = copy, *word;
+    char *argv[strlen(cmd) / 2 + 2];
+    int argc = 0;
+    strcpy(copy, cmd);
+    while ((word = strsep(&pos, " \t")) != NULL) {
+        if (*word != '\0')
+            argv[argc++] = word;
+    }
+    argv[argc] = NULL;
+    bool mproc;
+    int (*func)(int, char**);
+    // xargs forks and reaps its own children
+    if (argc == 0 || (func = get_builtin(argv[0], &mproc)) == NULL || mproc ||
+    func == &sf_xargs)
+        return NULL;
+
+    int mfd = memfd_create("sfish-cmdsub", MFD_CLOEXEC), saved;
+    if (mfd == -1)
+        return NULL;
+    for (int i = 0; i < argc; ++i)
+        argv[i] = var_word(argv[i]);
+    fflush(stdout);
+    saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    dup2(mfd, STDOUT_FILENO);
+    int ret = (*func)(argc, argv);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    last_return = W_EXITCODE(ret & 0xff, 0);
+    for (int i = 0; i < argc; ++i)
+        free(argv[i]);
+
+    off_t len = lseek(mfd, 0, SEEK_CUR);
+    char *out = malloc(len + 1);
+    len = pread(mfd, out, len, 0);
+    out[len > 0 ? len : 0] = '\0';
+    close(mfd);
+    return out;
+}
+
+// Output of cmd, which runs in a child writing to a pipe
+char* cmdsub_run(char *cmd) {
+    char *out;
+    if ((out = cmdsub_builtin(cmd)) != NULL) {
+        free(cmd);
+        return out;
     }
-    free(path_buf);
-    if (!valid) {
-        s_print(STDERR_FILENO, "No command '%s' found\n", 1, exec);
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        s_print(STDERR_FILENO, "Error creating pipes\n", 0);
+        free(cmd);
+        return strdup("");
     }
-    return valid;
-} 
+    // Fewer, larger reads for big outputs; the default size is kept on failure
+    fcntl(fds[0], F_SETPIPE_SZ, CMDSUB_PIPE_SIZE);
 
-bool make_args(char *cmd, int *argc, char **argv) {
-    *argc = 0;
-    char cmd_cpy[strlen(cmd) + 1], *arg, *argsec;
-    strcpy(cmd_cpy, cmd);
-    int delim_ind = 0;
-    
-    // exe arg0 arg1<file0>file1
-    while ((argsec = strsep(&cmd, "<>")) != NULL) {
-        if (cmd != NULL)
-            delim_ind = cmd - argsec - 1;
-        else
-            delim_ind = 0;
-        while ((arg = strsep(&argsec, " ")) != NULL) {
-            if (strlen(arg) != 0) {
-                argv[*argc] = calloc(strlen(arg) + 1, sizeof(char));
-                strcpy(argv[(*argc)++], arg);
-            }   
-        }
-        if (delim_ind > 0) {
-            if (cmd_cpy[delim_ind] == '>' || cmd_cpy[delim_ind] == '<') {
-                argv[*argc] = calloc(2, sizeof(char));
-                argv[(*argc)++][0] = cmd_cpy[delim_ind];
-            } 
-        }
-    }  
-    
-    
-    // Set rest of argv NULL
-    int i;
-    for (i = *argc; i < MAX_ARGS; ++i) {
-        argv[i] = NULL;
+    // Reap the child here rather than in sigchld_handler
+    sigset_t chld_mask, prev_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &prev_mask);
+    metric_inc(M_FORKS);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+        init_job_handlers();
+        cgroup_on = false;
+        jobs_head = NULL;
+        board = NULL;
+        eval_list(cmd);
+        exit(exit_code(last_return));
     }
-    
-    // Check for background flag
-    if (*argc != 0) {
-        int amperloc = strlen(argv[*argc - 1]) - 1;
-        if (strcmp(argv[*argc - 1], "&") == 0) {
-            --(*argc);
-            free(argv[*argc]);
-            argv[*argc] = NULL;
-        } else if (argv[*argc - 1][amperloc] == '&') {
-            argv[*argc - 1][amperloc] = '\0';
-        } else {
-            return true;
+    close(fds[1]);
+    free(cmd);
+
+    size_t cap = CMDSUB_READ, len = 0;
+    ssize_t n;
+    out = malloc(cap + 1);
+    while (pid != -1 && ((n = read(fds[0], out + len, cap - len)) > 0 || 
+    (n == -1 && errno == EINTR))) {
+        if (n > 0 && (len += n) + CMDSUB_READ / 2 > cap)
+            out = realloc(out, (cap <<= 1) + 1);
+    }
+    out[len] = '\0';
+    close(fds[0]);
+    int status, prev_errno = errno;
+    if (pid != -1 && waitpid(pid, &status, 0) != -1)
+        last_return = status;
+    errno = prev_errno;
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    return out;
+}
+
+// Append len bytes of str to the word at *word
+void word_cat(char **word, char *str, size_t len) {
+    size_t cur = strlen(*word);
+    *word = realloc(*word, cur + len + 1);
+    memcpy(*word + cur, str, len);
+    (*word)[cur + len] = '\0';
+}
+
+// Push word with each $(CMD) replaced by CMD's output, split into words
+void cmdsub_expand(char *word, char ***argv, int *argc, int *cap) {
+    char *cur = strdup(""), *pos = word, *open, *lit, *out, *field;
+    while ((open = strstr(pos, "$(")) != NULL) {
+        lit = strndup(pos, open - pos);
+        field = var_word(lit);
+        word_cat(&cur, field, strlen(field));
+        free(field);
+        free(lit);
+        size_t len = paren_len(open + 1);
+        out = cmdsub_run(strndup(open + 2, len - 2));
+        for (field = out; *field != '\0';) {
+            size_t n = strspn(field, " \t\n");
+            if (n > 0 && *cur != '\0') {
+                glob_push(argv, argc, cap, cur);
+                cur = strdup("");
+            }
+            field += n;
+            n = strcspn(field, " \t\n");
+            word_cat(&cur, field, n);
+            field += n;
         }
-        return false;
+        free(out);
+        pos = open + 1 + len;
     }
-    return true;
+    field = var_word(pos);
+    word_cat(&cur, field, strlen(field));
+    free(field);
+    if (*cur != '\0')
+        glob_push(argv, argc, cap, cur);
+    else
+        free(cur);
 }
 
 int make_job(char *input, struct job **new_job) {
+    if (strspn(input, " \t") == strlen(input)) {
+        free(input);
+        return 0;
+    }
+    struct parsed *parsed = parse_cache_get(input);
+    if (parsed == NULL) {
+        free(input);
+        return 0;
+    }
+
     // Create new_job
     (*new_job) = calloc(1, sizeof(struct job));
     (*new_job)->cmd = input;
-    (*new_job)->fg = true;
+    (*new_job)->fg = parsed->fg;
+    (*new_job)->pstat = parsed->pstat;
     (*new_job)->status = exec_status[RUNNING];
-    
-    // Copy input to sep
-    char cmd[strlen(input) + 1], *cmdp = cmd;
-    strcpy(cmd, input);
-    
-    if (strlen(input) == 0) {
-        free_job(*new_job);
-        return 0;
-    }
-
-    struct exec *cursor = calloc(1, sizeof(struct exec));
 
-    // Separate by pipe
-    char *exec_str;
-    while ((exec_str = strsep(&cmdp, "|")) != NULL) {
-        if (strlen(exec_str) == 0) {
+    // Instantiate stages from the parsed form
+    struct exec **tail = &(*new_job)->exec_head, *cursor;
+    for (struct stage *stage = parsed->stages; stage != NULL; stage = stage->next) {
+        cursor = *tail = calloc(1, sizeof(struct exec));
+        tail = &cursor->next;
+        cursor->srcfd = cursor->desfd = cursor->errfd = -1;
+        ++(*new_job)->nexec;
+        int cap = stage->argc + 1;
+        cursor->argv = calloc(cap, sizeof(char*));
+        for (int i = 0; i < stage->argc; ++i) {
+            // "$@" stays one word per function argument
+            if (strcmp(stage->argv[i], "$@") == 0) {
+                for (int j = 0; j < func_argc; ++j)
+                    glob_push(&cursor->argv, &cursor->argc, &cap, strdup(func_argv[j]));
+                continue;
+            }
+            // Expanded by the command it runs
+            if (i > 0 && procsub_word(stage->argv[i])) {
+                if (cursor->nsub++ == PROCSUB_MAX) {
+                    s_print(STDERR_FILENO, "Too many process substitutions\n", 0);
+                    free_job(*new_job);
+                    return 0;
+                }
+                glob_push(&cursor->argv, &cursor->argc, &cap, strdup(stage->argv[i]));
+                continue;
+            }
+            if (strstr(stage->argv[i], "$(") != NULL) {
+                cmdsub_expand(stage->argv[i], &cursor->argv, &cursor->argc, &cap);
+                continue;
+            }
+            char *word = var_word(stage->argv[i]);
+            if (i > 0 && glob_has_meta(word))
+                glob_expand(word, &cursor->argv, &cursor->argc, &cap);
+            else
+                glob_push(&cursor->argv, &cursor->argc, &cap, word);
+        }
+        if (cursor->argc == 0) {
             s_print(STDERR_FILENO, "Invalid command\n", 0);
             free_job(*new_job);
             return 0;
         }
-        // Make new node 
-        if ((*new_job)->exec_head == NULL) {
-            (*new_job)->exec_head = cursor;
-        } else {
-            cursor->next = calloc(1, sizeof(struct exec));
-            cursor = cursor->next;
-        }
-        cursor->srcfd = cursor->desfd = cursor->errfd = -1;
-        ++(*new_job)->nexec;
-        
-        // Fill new args
-        if (make_args(exec_str, &cursor->argc, cursor->argv) == false) {
-            (*new_job)->fg = false;
-        }
-
-        // Check again for bad input
-        if (cursor->argv[0] == NULL || check_exec(cursor->argv[0]) == false) {
+        if (stage->path != NULL)
+            cursor->path = strdup(stage->path);
+        else if (strchr(stage->argv[0], '$') != NULL &&
+        !check_exec(cursor->argv[0], &cursor->path)) {
             free_job(*new_job);
             return 0;
         }
-        
-        // Check for redirection, consume from args
-        bool non_args = false;
-        char fpb[PWD_SIZE], *fp = fpb;
-        memset(fp, 0, PWD_SIZE);
-        char cwdb[PWD_SIZE], *cwdp = cwdb;
-        getcwd(cwdp, PWD_SIZE);
-        for (int i = 1; i < cursor->argc - 1; ++i) {
-            var_cat(fp, 3, cwdp, "/", cursor->argv[i + 1]);
-            if (strcmp(cursor->argv[i], "<") == 0) {
-                if ((cursor->srcfd = open(fp, O_RDONLY)) == -1) {
-                    s_print(STDERR_FILENO, "Error opening file '%s'\n", 1,
-                    cursor->argv[i + 1]);
+
+        // Open redirections relative to the cwd dirfd
+        int *fd, flags;
+        for (struct redir *redir = stage->redirs; redir != NULL; redir = redir->next) {
+            if (redir->type == REDIR_HEREDOC || redir->type == REDIR_HERESTR) {
+                fd_close(cursor->srcfd);
+                char *text = var_word(redir->file);
+                if (fd_track(cursor->srcfd = heredoc_open(text, 
+                redir->type == REDIR_HERESTR), "heredoc") == -1) {
+                    s_print(STDERR_FILENO, "Error creating here-document\n", 0);
+                    free(text);
+                    free_job(*new_job);
+                    return 0;
+                }
+                free(text);
+                continue;
+            } else if (redir->type == REDIR_COIN || redir->type == REDIR_COOUT) {
+                bool in = redir->type == REDIR_COIN;
+                struct job *co = find_coproc(redir->file);
+                fd = in ? &cursor->srcfd : &cursor->desfd;
+                fd_close(*fd);
+                if (co == NULL || fd_track(*fd = fcntl(in ? co->co_out : co->co_in,
+                F_DUPFD_CLOEXEC, 3), "redir") == -1) {
+                    s_print(STDERR_FILENO, "%s: no such coprocess\n", 1, redir->file);
                     free_job(*new_job);
                     return 0;
                 }
-                non_args = true;
-            } else if (strcmp(cursor->argv[i], ">") == 0) {
-                cursor->desfd = 
-                open(fp, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IRGRP | 
-                S_IWGRP | S_IWUSR);
-                non_args = true;
-            } else if (strcmp(cursor->argv[i], "2>") == 0) {
-                cursor->errfd = 
-                open(fp, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IRGRP | 
-                S_IWGRP | S_IWUSR);
-                non_args = true;
-            } else if (strcmp(cursor->argv[i], ">>") == 0) {
-                cursor->desfd = 
-                open(fp, O_RDWR | O_APPEND | O_CREAT , S_IRUSR | S_IRGRP | 
-                S_IWGRP | S_IWUSR);
-                non_args = true;
+                continue;
+            } else if (redir->type == REDIR_IN) {
+                fd = &cursor->srcfd;
+                flags = O_RDONLY;
+            } else if (redir->type == REDIR_ERR) {
+                fd = &cursor->errfd;
+                flags = O_WRONLY | O_TRUNC | O_CREAT;
+            } else {
+                fd = &cursor->desfd;
+                flags = O_WRONLY | O_CREAT | 
+                (redir->type == REDIR_APPEND ? O_APPEND : O_TRUNC);
             }
-            if (non_args) {
-                free(cursor->argv[i]);
-                cursor->argv[i] = NULL;
+            fd_close(*fd);
+            char *file = var_word(redir->file);
+            if (fd_track(*fd = openat(cwd_fd, file, flags | O_CLOEXEC, 
+            S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR), "redir") == -1) {
+                s_print(STDERR_FILENO, "Error opening file '%s'\n", 1, file);
+                free(file);
+                free_job(*new_job);
+                return 0;
             }
-            memset(fp, 0, PWD_SIZE);
+            free(file);
         }
     }
     return (*new_job)->nexec;
 }
 
+int pstat_open(struct pstat_event *event, pid_t pid, bool on_exec) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | 
+    PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = on_exec;
+    attr.enable_on_exec = on_exec;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Attach counters to a stage before it is let through to exec
+void pstat_attach(struct job *job, struct exec *exec, bool on_exec) {
+    for (int i = 0; i < PSTAT_NEVENTS; ++i)
+        exec->perf_fds[i] = -1;
+    if (job->events == NULL) {
+        // Hardware counters are often missing in VMs
+        int fd = pstat_open(&pstat_hw[0], exec->pid, on_exec);
+        job->events = fd != -1 ? pstat_hw : pstat_sw;
+        if (fd != -1)
+            close(fd);
+    }
+    for (int i = 0; i < PSTAT_NEVENTS; ++i)
+        exec->perf_fds[i] = pstat_open(&job->events[i], exec->pid, on_exec);
+}
+
+void pstat_collect(struct exec *exec) {
+    uint64_t vals[3];
+    for (int i = 0; i < PSTAT_NEVENTS; ++i) {
+        exec->counts[i] = 0;
+        if (exec->perf_fds[i] == -1)
+            continue;
+        // Scale up for time lost to counter multiplexing
+        if (read(exec->perf_fds[i], vals, sizeof(vals)) == sizeof(vals) &&
+        vals[2] != 0)
+            exec->counts[i] = (double)vals[0] * vals[1] / vals[2];
+        close(exec->perf_fds[i]);
+    }
+}
+
+void pstat_report(struct job *job) {
+    struct exec *cursor = job->exec_head;
+    uint64_t total[PSTAT_NEVENTS] = {0};
+    if (job->events == NULL || cursor->perf_fds[0] == -1) {
+        s_print(STDERR_FILENO, "pstat: performance counters unavailable\n", 0);
+        return;
+    }
+    dprintf(STDERR_FILENO, "\n%-12s", "stage");
+    for (int i = 0; i < PSTAT_NEVENTS; ++i)
+        dprintf(STDERR_FILENO, " %15s", job->events[i].label);
+    if (job->events == pstat_hw)
+        dprintf(STDERR_FILENO, " %6s", "IPC");
+    dprintf(STDERR_FILENO, "\n");
+    for (; cursor != NULL; cursor = cursor->next) {
+        dprintf(STDERR_FILENO, "%-12.12s", cursor->argv[0]);
+        for (int i = 0; i < PSTAT_NEVENTS; ++i) {
+            dprintf(STDERR_FILENO, " %15lu", cursor->counts[i]);
+            total[i] += cursor->counts[i];
+        }
+        if (job->events == pstat_hw) {
+            dprintf(STDERR_FILENO, " %6.2f", cursor->counts[0] ? 
+            (double)cursor->counts[1] / cursor->counts[0] : 0.0);
+        }
+        dprintf(STDERR_FILENO, "\n");
+    }
+    if (job->nexec > 1) {
+        dprintf(STDERR_FILENO, "%-12s", "total");
+        for (int i = 0; i < PSTAT_NEVENTS; ++i)
+            dprintf(STDERR_FILENO, " %15lu", total[i]);
+        if (job->events == pstat_hw) {
+            dprintf(STDERR_FILENO, " %6.2f", total[0] ? 
+            (double)total[1] / total[0] : 0.0);
+        }
+        dprintf(STDERR_FILENO, "\n");
+    }
+}
+
 void setup_files(struct exec *exec, int *pipes, int npipes, int execn) {
     // Redirect
     if (exec->srcfd != -1) {
@@ -773,128 +3812,696 @@ void setup_files(struct exec *exec, int *pipes, int npipes, int execn) {
     }
 }
 
-void start_job(struct job *new_job) {
-    struct exec *cursor = new_job->exec_head;
+// Close fds from 3 up except the nkeep in keep, which stay open over exec
+void close_except(int *keep, int nkeep) {
+    unsigned low = 3;
+    int sorted[nkeep], k, j;
+    for (int i = 0; i < nkeep; ++i) {
+        for (k = keep[i], j = i; j > 0 && sorted[j - 1] > k; --j)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = k;
+    }
+    for (int i = 0; i < nkeep; ++i) {
+        if ((unsigned)sorted[i] < low)
+            continue;
+        if ((unsigned)sorted[i] > low)
+            close_range(low, sorted[i] - 1, 0);
+        fcntl(sorted[i], F_SETFD, 0);
+        low = sorted[i] + 1;
+    }
+    close_range(low, ~0U, 0);
+}
+
+// Launch the exec's process substitutions, replacing each with its /dev/fd path
+void procsub_start(struct exec *exec, int *pipes, int npipes) {
+    int nsub = 0, fds[2];
+    for (int i = 1; i < exec->argc && nsub < exec->nsub; ++i) {
+        if (!procsub_word(exec->argv[i]))
+            continue;
+        bool in = exec->argv[i][0] == '<';
+        exec->sub_fds[nsub] = -1;
+        exec->sub_pids[nsub] = -1;
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            s_print(STDERR_FILENO, "Error creating pipes\n", 0);
+            ++nsub;
+            continue;
+        }
+        metric_inc(M_FORKS);
+        if ((exec->sub_pids[nsub] = fork()) == 0) {
+            // Only this stage's end of the pipe may hold it open
+            dup2(fds[in], in ? STDOUT_FILENO : STDIN_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            for (int j = 0; j < npipes; ++j)
+                close(pipes[j]);
+            for (int j = 0; j < nsub; ++j)
+                close(exec->sub_fds[j]);
+            // Its jobs stay in this job's process group and cgroup, and the
+            // shell's jobs are not its to manage
+            cgroup_on = false;
+            jobs_head = NULL;
+            board = NULL;
+            eval_list(strndup(exec->argv[i] + 2, strlen(exec->argv[i]) - 3));
+            exit(exit_code(last_return));
+        }
+        close(fds[in]);
+        exec->sub_fds[nsub++] = fds[!in];
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/fd/%d", fds[!in]);
+        free(exec->argv[i]);
+        exec->argv[i] = strdup(path);
+    }
+}
+
+// Run the job's stages, returning the exit code of the last one
+int start_job(struct job *new_job) {
+    struct exec *cursor = new_job->exec_head;
+
+    // Captured jobs default stdout and stderr to their log
+    if (new_job->log != NULL) {
+        dup2(new_job->log->wfd, STDOUT_FILENO);
+        dup2(new_job->log->wfd, STDERR_FILENO);
+        close(new_job->log->wfd);
+        close(new_job->log->fd);
+    }
+
+    // Overwrite sigchld_handler
+    signal(SIGCHLD, NULL);
+
+    // Make pipes
+    int npipes = (new_job->nexec - 1) << 1, 
+    *pipes = calloc(npipes, sizeof(int));
+    for (int i = 0; i < npipes; i += 2) {
+        if (pipe2(pipes + i, O_CLOEXEC) == -1) {
+            s_print(STDERR_FILENO, "Error creating pipes\n", 0);             }
+    }
+
+    // Fork for all execs
+    int execn = 0;
+    int (*func)(int, char**);
+    int sync[2];
+    bool is_builtin;
+    while (cursor != NULL) {
+        // Producers start first, running alongside the stage
+        procsub_start(cursor, pipes, npipes);
+        // pstat stages wait for their counters before running
+        is_builtin = get_builtin(cursor->argv[0], NULL) != NULL;
+        if (new_job->pstat && pipe2(sync, O_CLOEXEC) == -1)
+            new_job->pstat = false;
+
+        // Exec
+        cursor->forked = now_ns();
+        metric_inc(M_FORKS);
+        if ((cursor->pid = fork()) == 0) {
+            trace_span("fork", cursor->argv[0], cursor->forked);
+            if (new_job->pstat) {
+                char go;
+                close(sync[1]);
+                read(sync[0], &go, 1);
+                close(sync[0]);
+            }
+            setpgid(0, getpgid(getpid()));
+            // Set redirection
+            setup_files(cursor, pipes, npipes, execn);
+            // Builtin
+            if ((func = get_builtin(cursor->argv[0], NULL)) != NULL) {
+                exit((*func)(cursor->argc, cursor->argv));
+            }
+            // Exec
+            else {
+                metric_inc(M_EXECS);
+                lat_record(L_LAUNCH, now_ns() - cursor->forked);
+                trace_instant("exec", cursor->argv[0]);
+                close_except(cursor->sub_fds, cursor->nsub);
+                execve(cursor->path != NULL ? cursor->path : cursor->argv[0],
+                cursor->argv, var_environ());
+                // Invalid exec
+                s_print(STDERR_FILENO, "%s: command not found\n", 1, 
+                cursor->argv[0]);
+                exit(127);
+            } 
+        } 
+        // Job parent
+        else {
+            if (new_job->pstat) {
+                pstat_attach(new_job, cursor, !is_builtin);
+                close(sync[0]);
+                close(sync[1]);
+            }
+            for (int i = 0; i < cursor->nsub; ++i)
+                close(cursor->sub_fds[i]);
+            // Close used pipes
+            if (npipes > 0) {
+                int pipeind = execn << 1;
+                if (pipeind <= npipes - 2) {
+                    close(pipes[pipeind + 1]);
+                }
+                if (pipeind > 0) {
+                    close(pipes[pipeind - 2]);
+                }
+            }
+         }
+        cursor = cursor->next;
+        ++execn;
+    }
+
+    // Reap stages only once the whole pipeline runs, so none blocks on a pipe
+    int ret = 0;
+    for (cursor = new_job->exec_head; cursor != NULL; cursor = cursor->next) {
+        int status, prev_errno = errno;
+        if (waitpid(cursor->pid, &status, 0) < 0) {
+            errno = prev_errno;
+        } else {
+            if (cursor->next == NULL)
+                ret = exit_code(status);
+            trace_event('X', "stage", cursor->argv[0], cursor->forked, 
+            now_ns() - cursor->forked);
+        }
+        if (new_job->pstat)
+            pstat_collect(cursor);
+    }
+    // Producers are part of the job; >(CMD) ones may still be draining
+    for (cursor = new_job->exec_head; cursor != NULL; cursor = cursor->next) {
+        for (int i = 0; i < cursor->nsub; ++i) {
+            if (cursor->sub_pids[i] > 0)
+                waitpid(cursor->sub_pids[i], NULL, 0);
+        }
+    }
+    if (new_job->pstat)
+        pstat_report(new_job);
+    return ret;
+}
+
+void init_job_handlers() {
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    rl_command_func_t sf_info;
+    rl_command_func_t sf_help_caller;
+    rl_command_func_t storepid_handler;
+    rl_command_func_t getpid_handler;
+    rl_bind_keyseq("\\C-p", NULL);
+    rl_bind_keyseq("\\C-h", NULL);
+    rl_bind_keyseq("\\C-b", NULL);
+    rl_bind_keyseq("\\C-g", NULL);
+}
+
+// Fork the job parent, waiting on the job if it is in the foreground
+pid_t launch_job(struct job *new_job, bool quiet) {
+    pid_t pid = 0;
+
+    // Keep sigchld_handler from reaping the job before it is set up
+    sigset_t chld_mask, prev_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &prev_mask);
+
+    // Add job to job list
+    add_job(new_job);
+    cgroup_job(new_job);
+    new_job->board_slot = -1;
+    if (!new_job->fg && joblog_on)
+        new_job->log = joblog_new(new_job);
+
+    // Fork for execs and wait if needed
+    new_job->started = now_ns();
+    metric_inc(M_FORKS);
+    if ((new_job->pid = fork()) == 0) {
+        // Stages forked from here on start in the job's group
+        if (new_job->cgroup != NULL)
+            cgroup_write(new_job->cgroup_fd, "cgroup.procs", "0");
+        sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+        init_job_handlers();
+        coproc_close_all();
+        // Process substitutions stay in the job's process group
+        if (getppid() == shell_pid)
+            setpgid(0, 0);
+        exit(start_job(new_job));
+    } 
+    board_update(new_job, SFBOARD_RUNNING, 0, NULL);
+    if (new_job->log != NULL) {
+        fd_close(new_job->log->wfd);
+        new_job->log->wfd = -1;
+    }
+    // Only the job's stages use its redirections
+    for (struct exec *cursor = new_job->exec_head; cursor != NULL; cursor = cursor->next) {
+        fd_close(cursor->srcfd);
+        fd_close(cursor->desfd);
+        fd_close(cursor->errfd);
+        cursor->srcfd = cursor->desfd = cursor->errfd = -1;
+    }
+    
+    // Server requests wait in the event loop so other sessions keep running
+    if (new_job->fg && server_session != NULL && func_depth == 0) {
+        new_job->fg = false;
+        server_session->wait_pid = new_job->pid;
+    }
+    // Foreground: wait for job to end
+    else if (new_job->fg) {
+        int status, prev_errno = errno;
+        struct rusage usage;
+        if (wait4(new_job->pid, &status, WUNTRACED, &usage) == -1) {
+            errno = prev_errno;
+        } 
+        // Stopped: keep job in list
+        else if (WIFSTOPPED(status)) {
+            new_job->fg = false;
+            new_job->status = exec_status[STOPPED];
+            board_update(new_job, SFBOARD_STOPPED, 0, NULL);
+        }
+        // Reap was successful: remove job from list
+        else {
+            job_finish(new_job, status, &usage);
+        }
+        last_return = status;
+    } else {
+        pid = new_job->pid;
+        if (!quiet)
+            s_print(STDOUT_FILENO, "[%d]  %d\n", 2, new_job->jid, new_job->pid);
+    } 
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    return pid;
+}
+
+// Returns the pid of a job left running in the background, else 0
+pid_t eval_cmd(char *input, bool quiet) {
+    struct job *new_job;
+
+    // Create job and and check for no command
+    uint64_t parse_start = now_ns();
+    if (!make_job(input, &new_job)) {
+        return 0;
+    }
+    lat_record(L_PARSE, now_ns() - parse_start);
+    trace_span("make_job", input, parse_start);
+    metric_inc(M_COMMANDS);
+
+    // Main process builtins and functions run in the shell when alone; coproc,
+    // every and at also take the stages after them as part of their command
+    bool mproc;
+    int (*func)(int, char**) = get_builtin(new_job->exec_head->argv[0], &mproc);
+    bool takes_line = func == &sf_coproc || func == &sf_every || func == &sf_at;
+    if (func != NULL && mproc && (new_job->nexec == 1 || takes_line)) {
+        builtin_input = new_job->cmd;
+        last_return = W_EXITCODE((*func)(new_job->exec_head->argc, 
+        new_job->exec_head->argv) & 0xff, 0);
+        builtin_input = NULL;
+        free_job(new_job);
+        return 0;
+    }
+    return launch_job(new_job, quiet);
+}
+
+// Delimiter of the first here-document after str, setting end past it
+char* heredoc_delim(char *str, char **end) {
+    while ((str = strstr(str, "<<")) != NULL) {
+        if (str[2] == '<') {
+            str += 3 + strspn(str + 3, "<");
+            continue;
+        }
+        str += 2 + strspn(str + 2, " \t");
+        size_t len = strcspn(str, " \t<>|&;\n");
+        *end = str + len;
+        return len > 0 ? strndup(str, len) : NULL;
+    }
+    return NULL;
+}
+
+// Append the bodies of cmd's here-documents from the front of bodies
+char* heredoc_attach(char *cmd, char **bodies) {
+    char *pos = cmd, *delim, *start = *bodies;
+    while ((delim = heredoc_delim(pos, &pos)) != NULL) {
+        char *line = *bodies, *nl;
+        size_t len = strlen(delim);
+        *bodies = line + strlen(line);
+        for (; *line != '\0'; line = nl + 1) {
+            nl = line + strcspn(line, "\n");
+            if ((size_t)(nl - line) == len && strncmp(line, delim, len) == 0) {
+                *bodies = *nl != '\0' ? nl + 1 : nl;
+                break;
+            }
+            if (*nl == '\0')
+                break;
+        }
+        free(delim);
+    }
+    if (*bodies == start)
+        return cmd;
+    char *attached = malloc(strlen(cmd) + (*bodies - start) + 2);
+    sprintf(attached, "%s\n%.*s", cmd, (int)(*bodies - start), start);
+    free(cmd);
+    return attached;
+}
+
+// Replace aliases naming the command of each pipeline stage
+char* alias_expand(char *cmd) {
+    char *expanded = strdup(cmd), *seen[ALIAS_DEPTH_MAX];
+    size_t pos = 0;
+    int nseen = 0;
+    while (expanded[pos] != '\0') {
+        pos += strspn(expanded + pos, " \t");
+        size_t len = strcspn(expanded + pos, " \t|<>&");
+        char name[len + 1];
+        strncpy(name, expanded + pos, len);
+        name[len] = '\0';
+        struct shfunc *alias = shfunc_find(aliases, name);
+
+        // An alias is not expanded again within its own expansion
+        bool loop = nseen == ALIAS_DEPTH_MAX;
+        for (int i = 0; i < nseen && !loop; ++i)
+            loop = strcmp(seen[i], name) == 0;
+        if (alias != NULL && !loop) {
+            seen[nseen++] = alias->name;
+            char *next = malloc(strlen(expanded) - len + strlen(alias->body) + 1);
+            memcpy(next, expanded, pos);
+            strcpy(next + pos, alias->body);
+            strcat(next, expanded + pos + len);
+            free(expanded);
+            expanded = next;
+            continue;
+        }
+        char *bar = strchr(expanded + pos, '|');
+        if (bar == NULL)
+            break;
+        pos = bar - expanded + 1;
+        nseen = 0;
+    }
+    return expanded;
+}
+
+int alias_define(char *args) {
+    args += strspn(args, " \t");
+    if (*args == '\0') {
+        for (int i = 0; i < FUNC_BUCKETS; ++i)
+            for (struct shfunc *alias = aliases[i]; alias != NULL; alias = alias->next)
+                dprintf(STDOUT_FILENO, "alias %s=%s\n", alias->name, alias->body);
+        return 0;
+    }
+    int len = var_name_len(args);
+    if (len == 0 || args[len] != '=') {
+        s_print(STDERR_FILENO, "alias: Invalid input\n", 0);
+        return 1;
+    }
+    char name[len + 1];
+    strncpy(name, args, len);
+    name[len] = '\0';
+    shfunc_set(aliases, name, strdup(args + len + 1));
+    return 0;
+}
+
+// Find the name and the body within braces of a NAME() { CMD; ... }
+// definition; 0 if line is not one, -1 if it is malformed
+int func_parse(char *line, char **name, int *name_len, char **body, size_t *body_len) {
+    char *cmd = line + strspn(line, " \t");
+    int len = var_name_len(cmd);
+    *body = cmd + len + strspn(cmd + len, " \t");
+    if (len == 0 || strncmp(*body, "()", 2) != 0)
+        return 0;
+    *body += 2 + strspn(*body + 2, " \t");
+    size_t end = strlen(*body);
+    while (end > 0 && strchr(" \t", (*body)[end - 1]) != NULL)
+        --end;
+    if ((*body)[0] != '{' || end < 2 || (*body)[end - 1] != '}')
+        return -1;
+    *name = cmd;
+    *name_len = len;
+    ++*body;
+    *body_len = end - 2;
+    return 1;
+}
+
+// Store NAME() { CMD; ... } definitions, false if line is not one
+bool func_define(char *line) {
+    char *cmd, *body;
+    int len;
+    size_t body_len;
+    int ret = func_parse(line, &cmd, &len, &body, &body_len);
+    if (ret == 0)
+        return false;
+    if (ret == -1) {
+        s_print(STDERR_FILENO, "Invalid function definition\n", 0);
+        last_return = W_EXITCODE(1, 0);
+        return true;
+    }
+    char name[len + 1];
+    strncpy(name, cmd, len);
+    name[len] = '\0';
+    shfunc_set(funcs, name, strndup(body, body_len));
+    // Parsed commands may have resolved the name elsewhere
+    ++path_cache_gen;
+    last_return = 0;
+    return true;
+}
+
+// Run ;-separated commands, defining functions and aliases on the way
+void eval_list(char *input) {
+    if (func_define(input)) {
+        free(input);
+        return;
+    }
+    // Here-document bodies follow the first line, in operator order
+    char *list = input, *cmd, *bodies = strchr(input, '\n');
+    if (bodies != NULL)
+        *bodies++ = '\0';
+    while ((cmd = split_next(&list, ';')) != NULL) {
+        cmd += strspn(cmd, " \t");
+        if (strncmp(cmd, "alias", 5) == 0 && (cmd[5] == '\0' || cmd[5] == ' ' || 
+        cmd[5] == '\t'))
+            last_return = W_EXITCODE(alias_define(cmd + 5), 0);
+        else if (bodies != NULL)
+            eval_cmd(heredoc_attach(alias_expand(cmd), &bodies), false);
+        else
+            eval_cmd(alias_expand(cmd), false);
+        // A server request picks up the rest once its job ends
+        if (server_session != NULL && server_session->wait_pid != 0 && func_depth == 0) {
+            if (list != NULL) {
+                server_session->pending = calloc(strlen(list) + 
+                (bodies != NULL ? strlen(bodies) + 1 : 0) + 1, sizeof(char));
+                var_cat(server_session->pending, 3, list, bodies != NULL ? "\n" : "",
+                bodies != NULL ? bodies : "");
+            }
+            break;
+        }
+    }
+    free(input);
+}
+
+// Run a function's body in the shell, forking only for its commands
+int sf_call(int argc, char **argv) {
+    struct shfunc *func = shfunc_find(funcs, argv[0]);
+    if (func == NULL)
+        return 127;
+    if (func_depth == FUNC_DEPTH_MAX) {
+        s_print(STDERR_FILENO, "%s: maximum function depth exceeded\n", 1, argv[0]);
+        return 1;
+    }
+    char **prev_argv = func_argv;
+    int prev_argc = func_argc;
+    func_argv = argv + 1;
+    func_argc = argc - 1;
+    ++func_depth;
+    last_return = 0;
+    eval_list(strdup(func->body));
+    --func_depth;
+    func_argv = prev_argv;
+    func_argc = prev_argc;
+    return exit_code(last_return);
+}
 
-    setpgid(0, 0);
+// Interval in ns from a number with an optional ms, s, m or h suffix
+uint64_t parse_interval(char *str) {
+    char *unit;
+    double val = strtod(str, &unit);
+    double scale = strcmp(unit, "ms") == 0 ? 1e6 : strcmp(unit, "m") == 0 ? 60e9 :
+    strcmp(unit, "h") == 0 ? 3600e9 : strcmp(unit, "s") == 0 || *unit == '\0' ? 1e9 : 0;
+    return val > 0 && unit != str ? (uint64_t)(val * scale) : 0;
+}
 
-    // Overwrite sigchld_handler
-    signal(SIGCHLD, NULL);
+void timer_remove(struct timer *timer) {
+    struct timer **cursor = &timers_head;
+    while (*cursor != timer)
+        cursor = &(*cursor)->next;
+    *cursor = timer->next;
+    fd_close(timer->fd);
+    free(timer->cmd);
+    free(timer->interval);
+    free(timer);
+}
 
-    // Make pipes
-    int npipes = (new_job->nexec - 1) << 1, 
-    *pipes = calloc(npipes, sizeof(int));
-    for (int i = 0; i < npipes; i += 2) {
-        if (pipe(pipes + i) > 0) {
-            s_print(STDERR_FILENO, "Error creating pipes\n", 0);             }
+// The command a builtin runs after its first skip words, as raw text so it
+// is parsed and expanded afresh, else rejoined from argv inside a pipeline
+char* builtin_rest(int argc, char **argv, int skip) {
+    if (builtin_input == NULL) {
+        size_t len = 1;
+        for (int i = skip; i < argc; ++i)
+            len += strlen(argv[i]) + 1;
+        char *cmd = calloc(len, sizeof(char));
+        for (int i = skip; i < argc; ++i)
+            var_cat(cmd, 2, argv[i], i + 1 < argc ? " " : "");
+        return cmd;
+    }
+    char *rest = builtin_input + strspn(builtin_input, " \t");
+    for (int i = 0; i < skip; ++i) {
+        rest += strcspn(rest, " \t");
+        rest += strspn(rest, " \t");
     }
+    // A trailing & backgrounded the builtin itself
+    size_t line = strcspn(rest, "\n"), len = line;
+    while (len > 0 && (rest[len - 1] == ' ' || rest[len - 1] == '\t'))
+        --len;
+    if (len > 0 && rest[len - 1] == '&')
+        --len;
+    // Here-document bodies stay with the command
+    char *cmd = calloc(len + strlen(rest + line) + 1, sizeof(char));
+    strncpy(cmd, rest, len);
+    strcat(cmd, rest + line);
+    return cmd;
+}
 
-    // Fork for all execs
-    int execn = 0;
-    int (*func)(int, char**);
-    while (cursor != NULL) {
-        // Exec
-        if ((cursor->pid = fork()) == 0) {
-            setpgid(0, getpgid(getpid()));
-            // Set redirection
-            setup_files(cursor, pipes, npipes, execn);
-            // Builtin
-            if ((func = get_builtin(cursor->argv[0], NULL)) != NULL) {
-                (*func)(cursor->argc, cursor->argv);
-                exit(EXIT_SUCCESS);
-            }
-            // Exec
-            else {
-                if(execvp(cursor->argv[0], cursor->argv)) {
-                    s_print(STDERR_FILENO, "%s: command not found\n", 1, 
-                    cursor->argv[0]);
-                    exit(EXIT_SUCCESS);        
-                }
-                // Invalid exec
-                else {
-                    s_print(STDERR_FILENO, "%s: command not found\n", 1, 
-                    cursor->argv[0]);
-                    exit(EXIT_SUCCESS);
-                }
-            } 
-        } 
-        // Job parent
-        else {
-            // Close used pipes
-            if (pipes[0] != -1) {
-                int pipeind = execn << 1;
-                if (pipeind <= npipes - 2) {
-                    close(pipes[pipeind + 1]);
-                }
-                if (pipeind > 0) {
-                    close(pipes[pipeind - 2]);
-                }
-            }
-            int status, prev_errno = errno;
-            if (waitpid(cursor->pid, &status, 0) < 0) {
-                 errno = prev_errno;
-             }
-         }
-        cursor = cursor->next;
-        ++execn;
+int timer_add(int argc, char **argv, bool repeat) {
+    uint64_t interval;
+    if (argc == 3 && strcmp(argv[1], "-d") == 0) {
+        int id = atoi(argv[2] + (argv[2][0] == 't'));
+        struct timer *cursor = timers_head;
+        while (cursor != NULL && cursor->id != id)
+            cursor = cursor->next;
+        if (cursor == NULL) {
+            s_print(STDERR_FILENO, "%s: %s: no such timer\n", 2, argv[0], argv[2]);
+            return 1;
+        }
+        timer_remove(cursor);
+        return 0;
+    }
+    if (argc < 3 || (interval = parse_interval(argv[1])) == 0) {
+        s_print(STDERR_FILENO, "%s: Invalid input\n", 1, argv[0]);
+        return 1;
+    }
+
+    struct timer *timer = calloc(1, sizeof(struct timer));
+    struct itimerspec spec = {{0, 0}, {interval / 1000000000, interval % 1000000000}};
+    if (repeat)
+        spec.it_interval = spec.it_value;
+    if (fd_track(timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC),
+    "timer") == -1 || timerfd_settime(timer->fd, 0, &spec, NULL) == -1) {
+        s_print(STDERR_FILENO, "%s: cannot create timer\n", 1, argv[0]);
+        fd_close(timer->fd);
+        free(timer);
+        return 1;
     }
+    timer->cmd = builtin_rest(argc, argv, 2);
+    timer->interval = strdup(argv[1]);
+    timer->repeat = repeat;
+    timer->id = ++timer_next_id;
+
+    struct timer **tail = &timers_head;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = timer;
+    s_print(STDOUT_FILENO, "[t%d]\n", 1, timer->id);
+    return 0;
 }
 
-void init_job_handlers() {
-    signal(SIGCHLD, SIG_DFL);
-    signal(SIGINT, SIG_DFL);
-    signal(SIGTSTP, SIG_DFL);
-    rl_command_func_t sf_info;
-    rl_command_func_t sf_help_caller;
-    rl_command_func_t storepid_handler;
-    rl_command_func_t getpid_handler;
-    rl_bind_keyseq("\\C-p", NULL);
-    rl_bind_keyseq("\\C-h", NULL);
-    rl_bind_keyseq("\\C-b", NULL);
-    rl_bind_keyseq("\\C-g", NULL);
+int sf_every(int argc, char **argv) {
+    return timer_add(argc, argv, true);
 }
 
-void eval_cmd(char *input) {
-    struct job *new_job;
+int sf_at(int argc, char **argv) {
+    return timer_add(argc, argv, false);
+}
 
-    // Create job and and check for no command
-    if (!make_job(input, &new_job)) {
-        return;
+int sf_board(int argc, char **argv) {
+    if (argc == 1) {
+        s_print(STDOUT_FILENO, "%s\n", 1, board != NULL ? board_path : "off");
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "on") == 0) {
+        if (board == NULL && !board_start()) {
+            s_print(STDERR_FILENO, "board: cannot create %s\n", 1, board_path);
+            return 1;
+        }
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "off") == 0) {
+        board_stop();
+        return 0;
     }
+    s_print(STDERR_FILENO, "board: Invalid input\n", 0);
+    return 1;
+}
 
-    // Check if job is main process builtin
-    bool mproc;
-    int (*func)(int, char**) = get_builtin(new_job->exec_head->argv[0], &mproc);
-    if (func != NULL && mproc) {
-        (*func)(new_job->exec_head->argc, new_job->exec_head->argv);
-        free_job(new_job);
-        return;
+// Start CMD as a background job on two pipes, reached by >&NAME and <&NAME
+int sf_coproc(int argc, char **argv) {
+    struct job *job;
+    if (argc == 1) {
+        for (job = jobs_head; job != NULL; job = job->next) {
+            if (job->coproc != NULL)
+                s_print(STDOUT_FILENO, "%s [%d] %s\n", 3, job->coproc, job->jid, job->cmd);
+        }
+        return 0;
+    }
+    if (argc < 3 || var_name_len(argv[1]) != (int)strlen(argv[1])) {
+        s_print(STDERR_FILENO, "coproc: Invalid input\n", 0);
+        return 1;
+    }
+    if (find_coproc(argv[1]) != NULL) {
+        s_print(STDERR_FILENO, "coproc: %s is already running\n", 1, argv[1]);
+        return 1;
+    }
+    if (!make_job(builtin_rest(argc, argv, 2), &job))
+        return 1;
+    struct exec *last = job->exec_head;
+    while (last->next != NULL)
+        last = last->next;
+    // Its input and output are the coprocess pipes
+    if (job->exec_head->srcfd != -1 || last->desfd != -1) {
+        s_print(STDERR_FILENO, "coproc: cannot redirect the input or output of %s\n", 1,
+        argv[1]);
+        free_job(job);
+        return 1;
     }
 
-    // Add job to job list
-    add_job(new_job);
+    // Requests go in through to, responses come back through from
+    int to[2], from[2];
+    bool piped = pipe2(to, O_CLOEXEC) != -1;
+    if (piped && pipe2(from, O_CLOEXEC) == -1) {
+        close(to[0]);
+        close(to[1]);
+        piped = false;
+    }
+    if (!piped) {
+        s_print(STDERR_FILENO, "Error creating pipes\n", 0);
+        free_job(job);
+        return 1;
+    }
+    job->exec_head->srcfd = fd_track(to[0], "redir");
+    last->desfd = fd_track(from[1], "redir");
+    job->co_in = fd_track(to[1], "coproc");
+    job->co_out = fd_track(from[0], "coproc");
+    job->coproc = strdup(argv[1]);
+    job->fg = false;
+    launch_job(job, false);
+    return 0;
+}
 
-    // Fork for execs and wait if needed
-    if ((new_job->pid = fork()) == 0) {
-        init_job_handlers();
-        start_job(new_job);
-        exit(EXIT_SUCCESS);
-    } 
-    
-    // Foreground: wait for job to end
-    if (new_job->fg) {
-        int status, prev_errno = errno;
-        if (waitpid(new_job->pid, &status, WUNTRACED) == -1) {
-            errno = prev_errno;
-        } 
-        // Reap was successful: remove job from list
-        else {
-            remove_job(new_job);
-        }
-        last_return = status;
-    } else {
-        s_print(STDOUT_FILENO, "[%d]  %d\n", 2, new_job->jid, new_job->pid);
-    } 
+// Launch the timer's command as a background job unless its last one runs
+void timer_fire(struct timer *timer) {
+    uint64_t ticks;
+    if (read(timer->fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return;
+    // Ticks missed while the shell was busy count as skipped
+    timer->skipped += ticks - 1;
+    if (timer->pid != 0 && find_job(timer->pid, false) != NULL) {
+        ++timer->skipped;
+        trace_instant("timer_skip", timer->cmd);
+        return;
+    }
+    char *input = calloc(strlen(timer->cmd) + 3, sizeof(char));
+    var_cat(input, 2, timer->cmd, " &");
+    trace_instant("timer", timer->cmd);
+    timer->pid = eval_cmd(input, true);
+    ++timer->runs;
+    if (!timer->repeat)
+        timer_remove(timer);
 }
 
 int storepid_handler(int count, int key) {
@@ -921,6 +4528,8 @@ int getpid_handler(int count, int key) {
             stored_job->jid, stored_job->pid);
             kill(-stored_job->pid, SIGSTOP);
             stored_job->status = exec_status[STOPPED];
+            board_update(stored_job, SFBOARD_STOPPED, 0, NULL);
+            trace_instant("stop", stored_job->cmd);
         } else {
             s_print(STDOUT_FILENO, "[%d] %d stopped by signal 15\n", 2,
             stored_job->jid, stored_job->pid);
@@ -971,6 +4580,8 @@ void sigtstp_handler(int sig) {
         if (cursor->fg) {
             kill(-cursor->pid, SIGTSTP);
             cursor->status = exec_status[STOPPED];
+            board_update(cursor, SFBOARD_STOPPED, 0, NULL);
+            trace_instant("stop", cursor->cmd);
             cursor->fg = false;
             break;
         }
@@ -986,14 +4597,13 @@ void sigchld_handler(int sig) {
     int prev_errno = errno, status;
     sigset_t all_mask, prev_mask;
     pid_t pid;
+    metric_inc(M_SIGCHLDS);
 
     // Check if responsible child is background
     struct job *job_cursor = jobs_head;
     while (job_cursor != NULL) {
         job_cursor = job_cursor->next;
     }
-
-    printf("In sigchld\n");
     
     // Block signals
     sigemptyset(&all_mask);
@@ -1002,14 +4612,20 @@ void sigchld_handler(int sig) {
 
     // Check status of signaling child
     struct job *signaled_job;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        signaled_job = find_job(pid, false);
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        if ((signaled_job = find_job(pid, false)) == NULL)
+            continue;
         if (WIFSTOPPED(status)) {
             signaled_job->status = exec_status[STOPPED];
+            board_update(signaled_job, SFBOARD_STOPPED, 0, NULL);
+            trace_instant("stop", signaled_job->cmd);
         } else if (WIFCONTINUED(status)) {
             signaled_job->status = exec_status[RUNNING];
-        } else if (WIFSIGNALED(status)) {
-            remove_job(signaled_job);
+            board_update(signaled_job, SFBOARD_RUNNING, 0, NULL);
+            trace_instant("continue", signaled_job->cmd);
+        } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            job_finish(signaled_job, status, &usage);
         }
     }
 
@@ -1023,14 +4639,667 @@ void init_handlers() {
     signal(SIGCHLD, sigchld_handler);
     signal(SIGINT, sigint_handler);
     signal(SIGTSTP, sigtstp_handler);
+}
+
+// Key bindings, which start readline, only for a terminal
+void init_keys() {
     rl_command_func_t sf_info;
     rl_command_func_t sf_help_caller;
     rl_command_func_t storepid_handler;
     rl_command_func_t getpid_handler;
+    rl_command_func_t hist_search_handler;
     rl_bind_keyseq("\\C-p", sf_info);
     rl_bind_keyseq("\\C-h", sf_help_caller);
     rl_bind_keyseq("\\C-b", storepid_handler);
     rl_bind_keyseq("\\C-g", getpid_handler);
+    rl_bind_keyseq("\\C-r", hist_search_handler);
+}
+
+// Swap the session's cwd and $? with the shell's
+void session_swap(struct session *session) {
+    int fd = cwd_fd, ret = last_return;
+    char *path = cwd_path;
+    cwd_fd = session->cwd_fd;
+    session->cwd_fd = fd;
+    cwd_path = session->cwd_path;
+    session->cwd_path = path;
+    fd = last_fd;
+    last_fd = session->last_fd;
+    session->last_fd = fd;
+    path = last_path;
+    last_path = session->last_path;
+    session->last_path = path;
+    last_return = session->last_return;
+    session->last_return = ret;
+    fchdir(cwd_fd);
+    update_pwd();
+}
+
+void session_reply(struct session *session) {
+    dprintf(session->sock, "%d\n", exit_code(session->last_return));
+}
+
+// Run a request with the client's stdio, replying now unless it waits on a job
+void session_eval(struct session *session, char *cmd) {
+    int saved[3];
+    fflush(stdout);
+    for (int i = 0; i < 3; ++i) {
+        saved[i] = fd_track(fcntl(i, F_DUPFD_CLOEXEC, 3), "server");
+        if (session->fds[i] != -1)
+            dup2(session->fds[i], i);
+    }
+    session_swap(session);
+    server_session = session;
+    eval_list(cmd);
+    server_session = NULL;
+    fflush(stdout);
+    session_swap(session);
+    for (int i = 0; i < 3; ++i) {
+        dup2(saved[i], i);
+        fd_close(saved[i]);
+    }
+    if (session->wait_pid == 0)
+        session_reply(session);
+}
+
+// Run queued requests, each NUL-terminated, until one waits on a job
+void session_next(struct session *session) {
+    char *end;
+    while (session->wait_pid == 0 && !session->closing &&
+    (end = memchr(session->buf, '\0', session->len)) != NULL) {
+        size_t len = end - session->buf + 1;
+        char *cmd = strdup(session->buf);
+        memmove(session->buf, session->buf + len, session->len -= len);
+        session_eval(session, cmd);
+    }
+}
+
+// Reply for sessions whose job ended and go on with their requests;
+// SIGCHLD must be blocked
+void server_check() {
+    for (struct session *cursor = sessions_head; cursor != NULL; cursor = cursor->next) {
+        if (cursor->wait_pid == 0 || find_job(cursor->wait_pid, false) != NULL)
+            continue;
+        int status = job_done_status(cursor->wait_pid, false);
+        cursor->last_return = status != -1 ? status : 0;
+        cursor->wait_pid = 0;
+        if (cursor->pending != NULL) {
+            char *cmd = cursor->pending;
+            cursor->pending = NULL;
+            session_eval(cursor, cmd);
+        } else {
+            session_reply(cursor);
+        }
+        session_next(cursor);
+    }
+}
+
+void session_free(struct session *session) {
+    fd_close(session->sock);
+    for (int i = 0; i < 3; ++i)
+        fd_close(session->fds[i]);
+    fd_close(session->cwd_fd);
+    fd_close(session->last_fd);
+    free(session->cwd_path);
+    free(session->last_path);
+    free(session->pending);
+    free(session->buf);
+    free(session);
+}
+
+// Drop sessions that exited or hung up
+void server_prune() {
+    struct session **cursor = &sessions_head, *done;
+    while (*cursor != NULL) {
+        if ((*cursor)->closing) {
+            done = *cursor;
+            *cursor = done->next;
+            session_free(done);
+        } else {
+            cursor = &(*cursor)->next;
+        }
+    }
+}
+
+void server_accept() {
+    int sock = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd_track(sock, "session") == -1)
+        return;
+    // Sessions start in the shell's cwd until the client sends its own
+    struct session *session = calloc(1, sizeof(struct session));
+    session->sock = sock;
+    session->fds[0] = session->fds[1] = session->fds[2] = -1;
+    session->cwd_fd = fd_track(fcntl(cwd_fd, F_DUPFD_CLOEXEC, 3), "cwd");
+    session->cwd_path = strdup(cwd_path);
+    session->last_fd = -1;
+    session->buf = malloc(SERVER_READ);
+    session->cap = SERVER_READ;
+    session->next = sessions_head;
+    sessions_head = session;
+}
+
+// Read requests and any stdin, stdout, stderr and cwd fds sent with them
+bool session_read(struct session *session) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } ctrl;
+    if (session->cap - session->len < SERVER_READ)
+        session->buf = realloc(session->buf, session->cap <<= 1);
+    struct iovec iov = {session->buf + session->len, session->cap - session->len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, 
+    .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)};
+    ssize_t n = recvmsg(session->sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return false;
+    session->len += n;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; 
+    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), fds[nfds];
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        for (int i = 0; i < nfds; ++i) {
+            if (i < 3) {
+                fd_close(session->fds[i]);
+                session->fds[i] = fd_track(fds[i], "session");
+            } else if (i == 3) {
+                char link[32], path[PATH_MAX];
+                ssize_t len;
+                snprintf(link, sizeof(link), "/proc/self/fd/%d", fds[i]);
+                if ((len = readlink(link, path, sizeof(path) - 1)) <= 0) {
+                    close(fds[i]);
+                    continue;
+                }
+                path[len] = '\0';
+                fd_close(session->cwd_fd);
+                free(session->cwd_path);
+                session->cwd_fd = fd_track(fds[i], "cwd");
+                session->cwd_path = strdup(path);
+            } else {
+                close(fds[i]);
+            }
+        }
+    }
+    return true;
+}
+
+// Serve command lines on the Unix socket at path instead of the terminal
+bool server_start(char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        s_print(STDERR_FILENO, "sfish: server socket '%s' unavailable\n", 1, path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    if (!sock_clear(path) ||
+    fd_track(server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), 
+    "server") == -1 ||
+    bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+    listen(server_fd, SERVER_BACKLOG) == -1) {
+        s_print(STDERR_FILENO, "sfish: server socket '%s' unavailable\n", 1, path);
+        return false;
+    }
+    // A client gone mid-reply must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+}
+
+// Send a request with this process's stdio and cwd, returning its exit code
+int client_send(int sock, char *cmd, int *fds, int nfds) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } ctrl;
+    struct iovec iov = {cmd, strlen(cmd) + 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (nfds > 0) {
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    if (sendmsg(sock, &msg, 0) == -1)
+        return -1;
+    char reply[16];
+    size_t len = 0;
+    while (len < sizeof(reply) - 1 && read(sock, reply + len, 1) == 1 && reply[len] != '\n')
+        ++len;
+    reply[len] = '\0';
+    return len > 0 ? atoi(reply) : -1;
+}
+
+// Run CMD, or each line of stdin, on the server at path
+int client_run(char *path, int argc, char **argv) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), ret = 0;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        path = "";
+    strcpy(addr.sun_path, path);
+    if (sock == -1 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        s_print(STDERR_FILENO, "sfish: cannot connect to '%s'\n", 1, path);
+        return 1;
+    }
+    int fds[4] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, 
+    open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)};
+    if (argc > 0) {
+        size_t len = 0;
+        for (int i = 0; i < argc; ++i)
+            len += strlen(argv[i]) + 1;
+        char cmd[len];
+        cmd[0] = '\0';
+        for (int i = 0; i < argc; ++i)
+            var_cat(cmd, 2, argv[i], i + 1 < argc ? " " : "");
+        ret = client_send(sock, cmd, fds, 4);
+    } else {
+        // Lines are the commands, so they get no stdin
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        for (int nfds = 4; (len = getline(&line, &cap, stdin)) != -1 && ret != -1; nfds = 0) {
+            if (len > 0 && line[len - 1] == '\n')
+                line[len - 1] = '\0';
+            ret = client_send(sock, line, fds, nfds);
+        }
+        free(line);
+    }
+    if (ret == -1) {
+        s_print(STDERR_FILENO, "sfish: lost connection to '%s'\n", 1, path);
+        return 1;
+    }
+    return ret;
+}
+
+void line_handler(char *cmd) {
+    struct timespec start;
+    if (cmd == NULL) {
+        // Input ended inside a here-document, run it as it stands
+        if (heredoc_text != NULL) {
+            eval_list(heredoc_text);
+            heredoc_text = NULL;
+        }
+        if (interactive)
+            rl_callback_handler_remove();
+        running = false;
+        return;
+    }
+    trace_instant("readline", cmd);
+    // Collect here-document lines until each delimiter is seen in turn
+    if (heredoc_text != NULL) {
+        bool last = strcmp(cmd, heredoc_delims[heredoc_next]) == 0 && 
+        ++heredoc_next == heredoc_ndelim;
+        heredoc_text = realloc(heredoc_text, strlen(heredoc_text) + strlen(cmd) + 2);
+        strcat(strcat(heredoc_text, "\n"), cmd);
+        free(cmd);
+        if (!last)
+            return;
+        cmd = heredoc_text;
+        heredoc_text = NULL;
+        for (int i = 0; i < heredoc_ndelim; ++i)
+            free(heredoc_delims[i]);
+        free(heredoc_delims);
+        heredoc_delims = NULL;
+    } else {
+        char *pos = cmd, *delim;
+        heredoc_ndelim = heredoc_next = 0;
+        while ((delim = heredoc_delim(pos, &pos)) != NULL) {
+            heredoc_delims = realloc(heredoc_delims, (heredoc_ndelim + 1) * sizeof(char*));
+            heredoc_delims[heredoc_ndelim++] = delim;
+        }
+        if (heredoc_ndelim > 0) {
+            heredoc_text = cmd;
+            if (interactive)
+                rl_set_prompt("> ");
+            return;
+        }
+    }
+    // eval_list takes ownership of cmd
+    char *line = strdup(cmd), *cwd = strdup(cwd_path);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    eval_list(cmd);
+    hist_record(line, cwd, &start);
+    free(line);
+    free(cwd);
+    if (interactive) {
+        prompt = make_prompt(prompt);
+        rl_set_prompt(prompt);
+    }
+    ++cmd_count;
+}
+
+void stdin_init() {
+    struct stat stats;
+    stdin_mode = STDIN_BYTE;
+    if (lseek(STDIN_FILENO, 0, SEEK_CUR) != -1) {
+        stdin_mode = STDIN_SEEK;
+    } else if (fstat(STDIN_FILENO, &stats) != -1 && S_ISFIFO(stats.st_mode) &&
+    pipe2(stdin_peek, O_CLOEXEC) != -1) {
+        fd_track(stdin_peek[0], "stdin");
+        fd_track(stdin_peek[1], "stdin");
+        stdin_mode = STDIN_TEE;
+    }
+}
+
+// Read stdin into buf, past its next newline only when it can be rewound
+ssize_t stdin_take(char *buf, size_t size) {
+    ssize_t n = 0, got;
+    if (stdin_mode == STDIN_SEEK)
+        return read(STDIN_FILENO, buf, size);
+    if (stdin_mode == STDIN_BYTE) {
+        while ((size_t)n < size && (got = read(STDIN_FILENO, buf + n, 1)) == 1 &&
+        buf[n++] != '\n');
+        return n > 0 ? n : got;
+    }
+    // Copy what the pipe holds without taking it, then take up to the newline
+    if ((n = tee(STDIN_FILENO, stdin_peek[1], size < STDIN_PEEK ? size : STDIN_PEEK, 0)) <= 0)
+        return n;
+    char peek[n];
+    if (read(stdin_peek[0], peek, n) != n)
+        return -1;
+    char *nl = memchr(peek, '\n', n);
+    return read(STDIN_FILENO, buf, nl != NULL ? nl - peek + 1 : n);
+}
+
+// Hand complete lines of non-terminal stdin to line_handler, without readline
+void stdin_read() {
+    static uint64_t *nl;
+    static size_t nl_cap;
+    size_t end;
+    if (stdin_cap - stdin_len < STDIN_READ)
+        stdin_buf = realloc(stdin_buf, stdin_cap += STDIN_READ);
+    ssize_t n = stdin_take(stdin_buf + stdin_len, stdin_cap - stdin_len);
+    if (n == -1 && errno == EINTR)
+        return;
+    stdin_len += n > 0 ? n : 0;
+    // Find every newline in the block in one pass
+    if (SCAN_WORDS(stdin_len) > nl_cap)
+        nl = realloc(nl, (nl_cap = SCAN_WORDS(stdin_len)) * sizeof(uint64_t));
+    scan_block(stdin_buf, stdin_len, nl, NULL);
+    size_t off = 0;
+    bool taken = false;
+    while (running && (end = scan_next(nl, stdin_len, off)) < stdin_len) {
+        // The line's commands read on from the end of the line
+        off_t rest = stdin_len - end - 1, pos = -1;
+        if (stdin_mode == STDIN_SEEK && rest > 0)
+            pos = lseek(STDIN_FILENO, -rest, SEEK_CUR);
+        line_handler(strndup(stdin_buf + off, end - off));
+        off = end + 1;
+        if (pos == -1)
+            continue;
+        // Keep the rest of the block unless they took some of it
+        if (lseek(STDIN_FILENO, 0, SEEK_CUR) != pos) {
+            off = stdin_len;
+            taken = true;
+            break;
+        }
+        lseek(STDIN_FILENO, rest, SEEK_CUR);
+    }
+    memmove(stdin_buf, stdin_buf + off, stdin_len -= off);
+    if (n <= 0 && running && !taken) {
+        // A last line without a newline still runs
+        if (stdin_len > 0)
+            line_handler(strndup(stdin_buf, stdin_len));
+        stdin_len = 0;
+        line_handler(NULL);
+    }
+}
+
+// Wait on the terminal and on captured job output
+void event_poll() {
+    int nfds = 1, nlogs, ntimers, nsessions;
+    struct joblog *cursor;
+    struct timer *timer;
+    struct session *session;
+    for (cursor = joblogs_head; cursor != NULL; cursor = cursor->next) {
+        if (cursor->fd != -1)
+            ++nfds;
+    }
+    for (timer = timers_head; timer != NULL; timer = timer->next)
+        ++nfds;
+    for (session = sessions_head; session != NULL; session = session->next)
+        ++nfds;
+    nfds += metrics_fd != -1;
+    struct pollfd fds[nfds];
+    struct joblog *logs[nfds];
+    struct timer *timers[nfds];
+    struct session *sessions[nfds];
+    fds[0].fd = server_fd != -1 ? server_fd : STDIN_FILENO;
+    fds[0].events = POLLIN;
+    nfds = 1;
+    for (cursor = joblogs_head; cursor != NULL; cursor = cursor->next) {
+        if (cursor->fd != -1) {
+            logs[nfds] = cursor;
+            fds[nfds].fd = cursor->fd;
+            fds[nfds++].events = POLLIN;
+        }
+    }
+    nlogs = nfds;
+    for (timer = timers_head; timer != NULL; timer = timer->next) {
+        timers[nfds] = timer;
+        fds[nfds].fd = timer->fd;
+        fds[nfds++].events = POLLIN;
+    }
+    ntimers = nfds;
+    for (session = sessions_head; session != NULL; session = session->next) {
+        sessions[nfds] = session;
+        fds[nfds].fd = session->sock;
+        fds[nfds++].events = POLLIN;
+    }
+    nsessions = nfds;
+    if (metrics_fd != -1) {
+        fds[nfds].fd = metrics_fd;
+        fds[nfds++].events = POLLIN;
+    }
+
+    // Jobs that end before the poll still wake it
+    sigset_t chld_mask, prev_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &prev_mask);
+    server_check();
+    int ready = ppoll(fds, nfds, NULL, &prev_mask);
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    if (ready == -1) {
+        server_prune();
+        return;
+    }
+    for (int i = 1; i < nlogs; ++i) {
+        if (fds[i].revents != 0)
+            joblog_drain(logs[i]);
+    }
+    joblog_prune();
+    // A timer's command may have cancelled timers polled after it
+    for (int i = nlogs; i < ntimers; ++i) {
+        for (timer = timers_head; timer != NULL && timer != timers[i]; timer = timer->next);
+        if (timer != NULL && fds[i].revents != 0)
+            timer_fire(timer);
+    }
+    for (int i = ntimers; i < nsessions; ++i) {
+        session = sessions[i];
+        if (fds[i].revents == 0 || session->closing)
+            continue;
+        if (!session_read(session))
+            session->closing = true;
+        else
+            session_next(session);
+    }
+    server_prune();
+    if (nsessions < nfds && fds[nsessions].revents != 0)
+        metrics_accept();
+    if (fds[0].revents != 0 && server_fd != -1)
+        server_accept();
+    else if (fds[0].revents != 0 && interactive)
+        rl_callback_read_char();
+    else if (fds[0].revents != 0)
+        stdin_read();
+}
+
+void startup_mark(char *phase) {
+    uint64_t now = now_ns();
+    if (phase != NULL && startup_nphases < STARTUP_PHASES) {
+        startup_phases[startup_nphases].name = phase;
+        startup_phases[startup_nphases++].ns = now - startup_last;
+    }
+    startup_last = now;
+}
+
+void startup_report() {
+    uint64_t total = 0;
+    for (int i = 0; i < startup_nphases; ++i) {
+        dprintf(STDERR_FILENO, "%-10s %10.1f us\n", startup_phases[i].name, 
+        startup_phases[i].ns / 1e3);
+        total += startup_phases[i].ns;
+    }
+    dprintf(STDERR_FILENO, "%-10s %10.1f us\n", "total", total / 1e3);
+}
+
+// Append an entry to the compiled rc in buf
+void rc_push(char **buf, size_t *len, enum rc_type type, char *name, size_t name_len,
+char *value, size_t value_len) {
+    struct rc_entry entry = {type, name_len, value_len};
+    *buf = realloc(*buf, *len + sizeof(entry) + name_len + value_len + 2);
+    memcpy(*buf + *len, &entry, sizeof(entry));
+    *len += sizeof(entry);
+    memcpy(*buf + *len, name, name_len);
+    (*buf)[*len += name_len] = '\0';
+    memcpy(*buf + ++*len, value, value_len);
+    (*buf)[*len += value_len] = '\0';
+    ++*len;
+}
+
+// Compile the rc text into header and entries: definitions and plain
+// assignments are stored split, everything else as commands for eval_list
+char* rc_compile(char *text, struct stat *stats, size_t *len) {
+    struct rc_header header = {RC_MAGIC, 0, stats->st_size, stats->st_mtim.tv_sec,
+    stats->st_mtim.tv_nsec, stats->st_ino};
+    char *buf = malloc(sizeof(header)), *line, *pos = text, *name, *body;
+    size_t body_len;
+    int name_len;
+    *len = sizeof(header);
+    while ((line = strsep(&pos, "\n")) != NULL) {
+        line += strspn(line, " \t");
+        bool export = strncmp(line, "export ", 7) == 0;
+        char *assign = export ? line + 7 + strspn(line + 7, " \t") : line;
+        name_len = var_name_len(assign);
+        if (*line == '\0' || *line == '#')
+            continue;
+        if (func_parse(line, &name, &name_len, &body, &body_len) == 1) {
+            rc_push(&buf, len, RC_FUNC, name, name_len, body, body_len);
+        } else if (strncmp(line, "alias ", 6) == 0 && 
+        (name_len = var_name_len(line + 6)) > 0 && line[6 + name_len] == '=') {
+            body = line + 7 + name_len;
+            rc_push(&buf, len, RC_ALIAS, line + 6, name_len, body, strlen(body));
+        } else if (name_len > 0 && assign[name_len] == '=' && 
+        strpbrk(assign, "$ \t|;<>&()") == NULL) {
+            body = assign + name_len + 1;
+            rc_push(&buf, len, export ? RC_EXPORT : RC_VAR, assign, name_len, body, 
+            strlen(body));
+        } else {
+            // Here-document bodies are part of the command
+            char *cmd = strdup(line), *delim, *at = line;
+            while ((delim = heredoc_delim(at, &at)) != NULL) {
+                while ((at = strsep(&pos, "\n")) != NULL) {
+                    cmd = realloc(cmd, strlen(cmd) + strlen(at) + 2);
+                    strcat(strcat(cmd, "\n"), at);
+                    if (strcmp(at, delim) == 0)
+                        break;
+                }
+                free(delim);
+                if (at == NULL)
+                    break;
+                at += strlen(at);
+            }
+            rc_push(&buf, len, RC_CMD, "", 0, cmd, strlen(cmd));
+            free(cmd);
+        }
+        ++header.count;
+    }
+    memcpy(buf, &header, sizeof(header));
+    return buf;
+}
+
+// Run ~/.sfishrc, or $SFISH_RC, from its compiled cache, rebuilding the
+// cache when the rc file changed
+void rc_load() {
+    char *file = var_get("SFISH_RC"), *home = var_get("HOME");
+    char rc_path[PATH_MAX], cache_path[PATH_MAX], tmp_path[PATH_MAX + 16];
+    struct stat stats, cache_stats;
+    if (file == NULL && home == NULL)
+        return;
+    if (file != NULL)
+        snprintf(rc_path, PATH_MAX, "%s", file);
+    else
+        snprintf(rc_path, PATH_MAX, "%s/.sfishrc", home);
+    if (snprintf(cache_path, PATH_MAX, "%s.cache", rc_path) >= PATH_MAX ||
+    stat(rc_path, &stats) == -1)
+        return;
+
+    // One read of the cache, trusted only if it matches the rc file
+    char *buf = NULL;
+    size_t len = 0;
+    struct rc_header *header;
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && fstat(fd, &cache_stats) != -1 && 
+    (size_t)cache_stats.st_size >= sizeof(struct rc_header)) {
+        buf = malloc(len = cache_stats.st_size);
+        header = (struct rc_header*)buf;
+        if (read(fd, buf, len) != (ssize_t)len || header->magic != RC_MAGIC ||
+        header->size != (uint64_t)stats.st_size || header->ino != stats.st_ino ||
+        header->mtime_sec != stats.st_mtim.tv_sec || 
+        header->mtime_nsec != stats.st_mtim.tv_nsec) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    if (fd != -1)
+        close(fd);
+
+    if (buf == NULL) {
+        if ((fd = open(rc_path, O_RDONLY | O_CLOEXEC)) == -1)
+            return;
+        char *text = malloc(stats.st_size + 1);
+        ssize_t n = read(fd, text, stats.st_size);
+        close(fd);
+        text[n > 0 ? n : 0] = '\0';
+        buf = rc_compile(text, &stats, &len);
+        free(text);
+        // Replace the cache whole so a concurrent start never reads half of it
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%d", cache_path, getpid());
+        if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) != -1) {
+            if (write(fd, buf, len) == (ssize_t)len)
+                rename(tmp_path, cache_path);
+            else
+                unlink(tmp_path);
+            close(fd);
+        }
+    }
+
+    header = (struct rc_header*)buf;
+    size_t off = sizeof(struct rc_header);
+    for (uint32_t i = 0; i < header->count && off + sizeof(struct rc_entry) <= len; ++i) {
+        struct rc_entry *entry = (struct rc_entry*)(buf + off);
+        char *name = buf + off + sizeof(struct rc_entry);
+        char *value = name + entry->name_len + 1;
+        off += sizeof(struct rc_entry) + entry->name_len + entry->value_len + 2;
+        if (off > len)
+            break;
+        if (entry->type == RC_FUNC) {
+            shfunc_set(funcs, name, strdup(value));
+            ++path_cache_gen;
+        } else if (entry->type == RC_ALIAS) {
+            shfunc_set(aliases, name, strdup(value));
+        } else if (entry->type == RC_VAR || entry->type == RC_EXPORT) {
+            var_set(name, value, entry->type == RC_EXPORT);
+        } else {
+            eval_list(strdup(value));
+        }
+    }
+    free(buf);
 }
 
 int main(int argc, char** argv) {
@@ -1038,28 +5307,62 @@ int main(int argc, char** argv) {
     rl_catch_signals = 0;
     //This is disable readline's default signal handlers, since you are going
     //to install your own.
+    if (argc >= 3 && strcmp(argv[1], "--connect") == 0)
+        return client_run(argv[2], argc - 3, argv + 3);
+    char *server_path = NULL;
+    bool profile = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--startup-profile") == 0)
+            profile = true;
+        else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc)
+            server_path = argv[++i];
+    }
+    startup_mark(NULL);
+    var_init();
+    startup_mark("vars");
+    metrics_init();
+    if (var_get("SFISH_TRACE") != NULL)
+        trace_start(var_get("SFISH_TRACE"));
+    startup_mark("metrics");
     init_handlers();
-    printf("pid: %d\n", getpid());
+    shell_pid = getpid();
+    interactive = server_path == NULL && isatty(STDIN_FILENO);
+    if (interactive)
+        printf("pid: %d\n", getpid());
 
-    last_return = -1;
+    last_return = 0;
     cmd_count = 0;
-    pwd = calloc(PWD_SIZE, sizeof(char));
-    machine = calloc(HOSTNAME_SIZE, sizeof(char));
-    char *prompt = calloc(PROMPT_SIZE, sizeof(char));
-    make_prompt(prompt);
-
-    char *test1 = calloc(100, 1);
-    strcpy(test1, "cd ../testexecs");
-    eval_cmd(test1);
+    init_cwd();
+    startup_mark("cwd");
+    hist_init();
+    startup_mark("history");
+    rc_load();
+    startup_mark("rc");
 
-    char *cmd;
-    while((cmd = readline(prompt)) != NULL) {
-        eval_cmd(cmd);
-        make_prompt(prompt);
-        ++cmd_count;
+    if (server_path != NULL) {
+        if (!server_start(server_path))
+            return EXIT_FAILURE;
+        startup_mark("server");
+    } else if (interactive) {
+        init_keys();
+        machine = calloc(HOSTNAME_SIZE, sizeof(char));
+        prompt = make_prompt(NULL);
+        rl_callback_handler_install(prompt, line_handler);
+        startup_mark("readline");
+    } else {
+        stdin_init();
+    }
+    if (profile)
+        startup_report();
+    while (running) {
+        event_poll();
     }
 
+    cgroup_stop();
+    trace_stop();
     free(pwd);
+    free(cwd_path);
+    free(last_path);
     free(machine);
     free(prompt);
 
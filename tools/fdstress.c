@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Run -n N redirected commands (default 100000) through SFISH (default
+// bin/sfish) in a scratch directory, counting its open fds every -i commands.
+// Exits 1 if the count ever grows past the one taken after the first round.
+
+#define MARK "fdstress-mark"
+
+// Redirections the shell opens itself, in-shell builtins and forked commands
+char *cmds[] = {
+    "cd . > out1", "cd . >> out2", "cd . < out1", "cd . 2> err1", "cd . <<< word",
+    "export FDSTRESS=1 > out3", "wait 2> err2",
+    "pwd > out4", "echo line >> out5", "cat < out4 > out6 2> err3"
+};
+
+int remove_ent(const char *path, const struct stat *stats, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+int count_fds(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    DIR *dir = opendir(path);
+    struct dirent *ent;
+    int n = 0;
+    if (dir == NULL)
+        return -1;
+    while ((ent = readdir(dir)) != NULL)
+        n += ent->d_name[0] != '.';
+    closedir(dir);
+    return n;
+}
+
+// Wait until the shell has run every command sent so far
+bool sync_shell(FILE *in, FILE *out) {
+    char line[256];
+    fprintf(in, "echo " MARK "\n");
+    fflush(in);
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (strcmp(line, MARK "\n") == 0)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    long total = 100000, interval = 5000;
+    char *sfish = "bin/sfish", dir[] = "/tmp/fdstress.XXXXXX";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:")) != -1) {
+        if (opt == 'n')
+            total = atol(optarg);
+        else if (opt == 'i')
+            interval = atol(optarg);
+        else
+            total = 0;
+    }
+    if (optind < argc)
+        sfish = argv[optind];
+    if (total <= 0 || interval <= 0 || (sfish = realpath(sfish, NULL)) == NULL) {
+        fprintf(stderr, "usage: fdstress [-n N] [-i N] [SFISH]\n");
+        return 2;
+    }
+    // The shell runs in a scratch directory
+    if (mkdtemp(dir) == NULL) {
+        perror("fdstress: mkdtemp");
+        return 2;
+    }
+
+    // The shell reads commands from one pipe and answers marks on another
+    int to[2], from[2];
+    if (pipe(to) == -1 || pipe(from) == -1) {
+        perror("fdstress: pipe");
+        return 2;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(to[0], STDIN_FILENO);
+        dup2(from[1], STDOUT_FILENO);
+        close(to[0]);
+        close(to[1]);
+        close(from[0]);
+        close(from[1]);
+        // Keep its history and rc away from the user's
+        if (chdir(dir) == -1 || setenv("HOME", dir, 1) == -1)
+            _exit(127);
+        unsetenv("SFISH_HISTFILE");
+        unsetenv("SFISH_RC");
+        execl(sfish, "sfish", (char*)NULL);
+        _exit(127);
+    }
+    close(to[0]);
+    close(from[1]);
+    signal(SIGPIPE, SIG_IGN);
+    FILE *in = fdopen(to[1], "w"), *out = fdopen(from[0], "r");
+
+    int base = -1, peak = 0, ncmds = sizeof(cmds) / sizeof(char*);
+    bool grew = false;
+    for (long i = 0; i < total; ++i) {
+        fprintf(in, "%s\n", cmds[i % ncmds]);
+        if ((i + 1) % interval != 0 && i + 1 != total)
+            continue;
+        if (!sync_shell(in, out)) {
+            fprintf(stderr, "fdstress: sfish exited after %ld commands\n", i + 1);
+            return 1;
+        }
+        int n = count_fds(pid);
+        // Counted once every command has opened what it caches
+        if (base == -1)
+            base = n;
+        if (n > peak)
+            peak = n;
+        if (n > base && !grew) {
+            fprintf(stderr, "fdstress: %d fds after %ld commands, %d after the first"
+            " %ld\n", n, i + 1, base, interval);
+            grew = true;
+        }
+    }
+    fprintf(in, "exit\n");
+    fclose(in);
+    fclose(out);
+    waitpid(pid, NULL, 0);
+    nftw(dir, remove_ent, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%ld commands, fds %d at start, %d at peak: %s\n", total, base, peak,
+    grew ? "FAIL" : "ok");
+    return grew ? 1 : 0;
+}
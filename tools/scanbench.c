@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scan.h"
+
+// Throughput of each scan_block version, in MB/s, over a generated script of
+// -s MB (default 16), best of -r runs (default 5). Exits 1 if a version marks
+// different bytes than the scalar one
+
+#define TAIL_MAX 256
+
+char *words[] = {"echo", "ls", "-l", "grep", "foo", "/tmp/out.txt", "\"a b\"", 
+"'c d'", "$(date)", "<(sort x)", "2>", ">>", "<", "|", "&&", ";", "${HOME}"};
+
+char* make_script(size_t size) {
+    char *buf = malloc(size + 1);
+    size_t len = 0;
+    srand(1);
+    while (len < size) {
+        size_t n = 1 + rand() % 12, wlen;
+        for (size_t i = 0; i < n && len < size; ++i) {
+            const char *word = words[rand() % (sizeof(words) / sizeof(char*))];
+            wlen = strlen(word);
+            if (len + wlen + 1 > size)
+                break;
+            memcpy(buf + len, word, wlen);
+            len += wlen;
+            buf[len++] = i + 1 == n ? '\n' : ' ';
+        }
+        if (len + 16 > size)
+            break;
+    }
+    memset(buf + len, '\n', size - len);
+    buf[size] = '\0';
+    return buf;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t count(const uint64_t *mask, size_t words) {
+    size_t total = 0;
+    for (size_t i = 0; i < words; ++i)
+        total += __builtin_popcountll(mask[i]);
+    return total;
+}
+
+// The current version against the scalar one on lengths ending mid-word
+bool same_tails(const char *script) {
+    uint64_t nl[SCAN_WORDS(TAIL_MAX)], ops[SCAN_WORDS(TAIL_MAX)];
+    uint64_t want_nl[SCAN_WORDS(TAIL_MAX)], want_ops[SCAN_WORDS(TAIL_MAX)];
+    const char *impl = scan_impl();
+    for (size_t len = 1; len <= TAIL_MAX; ++len) {
+        scan_force("scalar");
+        scan_block(script, len, want_nl, want_ops);
+        scan_force(impl);
+        scan_block(script, len, nl, ops);
+        if (memcmp(nl, want_nl, SCAN_WORDS(len) * sizeof(uint64_t)) != 0 ||
+        memcmp(ops, want_ops, SCAN_WORDS(len) * sizeof(uint64_t)) != 0)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = 16;
+    int runs = 5;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-s") == 0) {
+            mb = strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            runs = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "usage: scanbench [-s MB] [-r RUNS]\n");
+            return 1;
+        }
+    }
+    if (mb == 0 || runs <= 0) {
+        fprintf(stderr, "usage: scanbench [-s MB] [-r RUNS]\n");
+        return 1;
+    }
+    size_t size = mb << 20, nwords = SCAN_WORDS(size);
+    char *script = make_script(size);
+    uint64_t *nl = malloc(nwords * sizeof(uint64_t));
+    uint64_t *ops = malloc(nwords * sizeof(uint64_t));
+    uint64_t *want_nl = malloc(nwords * sizeof(uint64_t));
+    uint64_t *want_ops = malloc(nwords * sizeof(uint64_t));
+    char *impls[] = {"scalar", "sse2", "avx2"};
+    int ret = 0;
+
+    printf("script %zu MB, best of %d\n", mb, runs);
+    for (int i = 0; i < 3; ++i) {
+        if (!scan_force(impls[i])) {
+            printf("%-8s unsupported\n", impls[i]);
+            continue;
+        }
+        double best = 0;
+        for (int run = 0; run < runs; ++run) {
+            double start = now();
+            scan_block(script, size, nl, ops);
+            double took = now() - start;
+            if (run == 0 || took < best)
+                best = took;
+        }
+        // Every version has to mark the same bytes as the scalar one, whole
+        // blocks and the tails of short odd lengths alike
+        if (i == 0) {
+            memcpy(want_nl, nl, nwords * sizeof(uint64_t));
+            memcpy(want_ops, ops, nwords * sizeof(uint64_t));
+        }
+        bool same = memcmp(nl, want_nl, nwords * sizeof(uint64_t)) == 0 &&
+        memcmp(ops, want_ops, nwords * sizeof(uint64_t)) == 0 && same_tails(script);
+        printf("%-8s %9.1f MB/s  %zu lines  %zu operators%s\n", impls[i], mb / best, 
+        count(nl, nwords), count(ops, nwords), same ? "" : "  MISMATCH");
+        if (!same)
+            ret = 1;
+    }
+    free(script);
+    free(nl);
+    free(ops);
+    free(want_nl);
+    free(want_ops);
+    return ret;
+}
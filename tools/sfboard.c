@@ -0,0 +1,109 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "sfboard.h"
+
+// Print the job boards of the given shells, or of every shell publishing one,
+// once or every -i MS
+
+#define MAPPED_MAX 256
+
+char *states[] = {"Free", "Running", "Stopped", "Done"};
+
+// Boards stay mapped across -i rounds, so polling one costs no syscalls
+struct mapped {
+    pid_t pid;
+    const struct sfboard *board;
+    bool seen;
+} mapped[MAPPED_MAX];
+int nmapped;
+
+void unmap_at(int i) {
+    sfboard_unmap(mapped[i].board);
+    mapped[i] = mapped[--nmapped];
+}
+
+// The board of pid, kept mapped unless the table is full
+const struct sfboard* board_get(pid_t pid, bool *kept) {
+    *kept = true;
+    for (int i = 0; i < nmapped; ++i) {
+        if (mapped[i].pid != pid)
+            continue;
+        if (sfboard_live(mapped[i].board)) {
+            mapped[i].seen = true;
+            return mapped[i].board;
+        }
+        unmap_at(i);
+        break;
+    }
+    const struct sfboard *board = sfboard_map(pid);
+    if (board == NULL || nmapped == MAPPED_MAX) {
+        *kept = false;
+        return board;
+    }
+    mapped[nmapped++] = (struct mapped){pid, board, true};
+    return board;
+}
+
+void print_board(pid_t pid) {
+    struct sfboard_slot slots[SFBOARD_SLOTS];
+    struct timespec now;
+    bool kept;
+    const struct sfboard *board = board_get(pid, &kept);
+    if (board == NULL) {
+        fprintf(stderr, "sfboard: no board for %d\n", (int)pid);
+        return;
+    }
+    int n = sfboard_snapshot(board, slots);
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    printf("sfish %d\n", (int)pid);
+    for (int i = 0; i < n; ++i) {
+        char status[16] = "";
+        if (slots[i].state == SFBOARD_DONE && WIFSIGNALED(slots[i].exit_status))
+            snprintf(status, sizeof(status), "sig %d", WTERMSIG(slots[i].exit_status));
+        else if (slots[i].state == SFBOARD_DONE)
+            snprintf(status, sizeof(status), "exit %d", WEXITSTATUS(slots[i].exit_status));
+        uint64_t end = slots[i].state == SFBOARD_DONE ? slots[i].updated : now_ns;
+        printf("[%d]  %-8s %-8s %7d %9.3fs  cpu %.3fs  mem %.1fM  %s\n", slots[i].jid,
+        states[slots[i].state & 3], status, slots[i].pgid, 
+        (end - slots[i].started) / 1e9, slots[i].cpu_usec / 1e6, 
+        slots[i].mem_peak / 1048576.0, slots[i].cmd);
+    }
+    if (!kept)
+        sfboard_unmap(board);
+}
+
+int main(int argc, char **argv) {
+    int interval = 0, opt = 1;
+    if (argc > 2 && strcmp(argv[1], "-i") == 0) {
+        interval = atoi(argv[2]);
+        opt = 3;
+    }
+    do {
+        for (int i = 0; i < nmapped; ++i)
+            mapped[i].seen = false;
+        if (opt < argc) {
+            for (int i = opt; i < argc; ++i)
+                print_board(atoi(argv[i]));
+        } else {
+            DIR *dir = opendir("/dev/shm");
+            struct dirent *ent;
+            int pid;
+            while (dir != NULL && (ent = readdir(dir)) != NULL) {
+                if (sscanf(ent->d_name, "sfish-board-%d", &pid) == 1)
+                    print_board(pid);
+            }
+            if (dir != NULL)
+                closedir(dir);
+        }
+        // Drop boards of shells that went away
+        for (int i = nmapped - 1; i >= 0; --i) {
+            if (!mapped[i].seen)
+                unmap_at(i);
+        }
+        fflush(stdout);
+    } while (interval > 0 && usleep(interval * 1000) == 0);
+    return EXIT_SUCCESS;
+}